@@ -0,0 +1,127 @@
+#!/usr/bin/env python3
+
+###########################################################################
+# Pack a ProDOS system file into a self-extracting one
+#
+# The program, which loads at $2000, is LZ compressed and appended to the
+# decompressor stub built from lzstub.s.  See lzstub.s for the format.
+#
+# usage: lzpack.py stub.bin program.bin packed.system
+#
+###########################################################################
+
+import sys
+
+DEST = 0x2000       # Program load address
+PACKED = 0x2100     # Packed data follows the one page stub
+TOP = 0xbf00        # ProDOS global page
+NPAGES = 3          # Offset of page count in the stub, after the JMP
+
+MINMATCH = 3
+MAXMATCH = 0x7f + MINMATCH
+MAXLIT = 0x80
+MAXCHAIN = 256      # Earlier positions tried for each match
+
+#
+# Find the longest earlier match for data[pos:], using hash chains keyed
+# on the next MINMATCH bytes.  Returns (length, distance).
+#
+def longest(data, pos, chains):
+    best, dist = 0, 0
+    key = data[pos:pos + MINMATCH]
+    maxlen = min(MAXMATCH, len(data) - pos)
+    for prev in reversed(chains.get(key, [])[-MAXCHAIN:]):
+        n = 0
+        while n < maxlen and data[prev + n] == data[pos + n]:
+            n += 1
+        if n > best:
+            best, dist = n, pos - prev
+            if n == maxlen:
+                break
+    return best, dist
+
+#
+# Greedy LZ compression, with one step of lazy matching.  Returns the
+# packed bytes and, for each token, the (input, output) offsets at which
+# it starts, which are used to check that in place unpacking is safe.
+#
+def compress(data):
+    out = bytearray()
+    marks = []
+    lits = bytearray()
+    chains = {}
+    pos = 0
+
+    def addchain(p):
+        if p + MINMATCH <= len(data):
+            chains.setdefault(data[p:p + MINMATCH], []).append(p)
+
+    def flushlits():
+        nonlocal lits
+        for i in range(0, len(lits), MAXLIT):
+            run = lits[i:i + MAXLIT]
+            marks.append((len(out), pos - len(lits) + i))
+            out.append(len(run) - 1)
+            out.extend(run)
+        lits = bytearray()
+
+    while pos < len(data):
+        n, d = longest(data, pos, chains) if pos + MINMATCH <= len(data) \
+               else (0, 0)
+        if n >= MINMATCH:
+            addchain(pos)
+            n2, d2 = longest(data, pos + 1, chains) \
+                     if pos + 1 + MINMATCH <= len(data) else (0, 0)
+            if n2 > n + 1:
+                lits.append(data[pos])
+                pos += 1
+                continue
+            flushlits()
+            marks.append((len(out), pos))
+            out.extend((0x80 | (n - MINMATCH), d & 0xff, d >> 8))
+            for p in range(pos + 1, pos + n):
+                addchain(p)
+            pos += n
+        else:
+            addchain(pos)
+            lits.append(data[pos])
+            pos += 1
+    flushlits()
+    marks.append((len(out), pos))
+    out.extend((0x80, 0x00, 0x00))
+    return out, marks
+
+def main():
+    if len(sys.argv) != 4:
+        print("usage: lzpack.py stub.bin program.bin packed.system")
+        sys.exit(1)
+    stub = bytearray(open(sys.argv[1], "rb").read())
+    data = open(sys.argv[2], "rb").read()
+    if len(stub) > PACKED - DEST:
+        print("lzpack: stub is more than one page")
+        sys.exit(1)
+
+    packed, marks = compress(data)
+    npages = (len(packed) + 0xff) // 0x100
+    if PACKED + npages * 0x100 > TOP:
+        print("lzpack: packed program too big")
+        sys.exit(1)
+
+    # Unpacking reads from the top of memory and writes from DEST, so it
+    # must never write beyond the start of a token it has yet to read
+    start = TOP - npages * 0x100
+    ends = [o for (i, o) in marks[1:]] + [len(data)]
+    for (i, o), end in zip(marks, ends):
+        if DEST + end > start + i:
+            print("lzpack: program too big to unpack in place")
+            sys.exit(1)
+
+    stub[NPAGES] = npages
+    stub += bytes(PACKED - DEST - len(stub))
+    packed += bytes(npages * 0x100 - len(packed))
+    open(sys.argv[3], "wb").write(stub + packed)
+    print("lzpack: %u bytes packed to %u (%u%%)" %
+          (len(data), len(stub) + len(packed),
+           (len(stub) + len(packed)) * 100 // len(data)))
+
+main()
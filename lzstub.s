@@ -0,0 +1,137 @@
+;
+; Self-extracting stub for SORTDIR.SYSTEM
+;
+; ProDOS loads the system file at $2000.  This stub occupies the first
+; page, and the program packed by lzpack.py follows from $2100, padded
+; to a whole number of pages.  The stub moves the packed data up to the
+; top of memory, copies the decompressor to page 3, and unpacks the
+; program to $2000, where it is started as if it had been loaded there.
+; The cc65 startup code then copies the LC segment to $D400 as usual.
+;
+; Packed format, a sequence of tokens:
+;   $00-$7F           Literal run, followed by token+1 bytes
+;   $80-$FF lo hi     Copy token-$80+3 bytes from lo/hi bytes back
+;   $80 $00 $00       End of data
+;
+
+        .setcpu         "65C02"
+
+TOP     =       $BF00           ; ProDOS global page
+DEST    =       $2000           ; Program is unpacked and run here
+PACKED  =       $2100           ; Packed data follows the stub
+DECOMP  =       $0300           ; Decompressor is run from page 3
+
+src     :=      $80             ; Next packed byte
+dst     :=      $82             ; Next unpacked byte
+ptr     :=      $84             ; Source of a copy
+len     :=      $86             ; Bytes left to copy
+
+        .code
+
+        jmp     start
+npages: .byte   $00             ; Pages of packed data, set by lzpack.py
+
+start:
+        ; Copy the decompressor to page 3, out of the way of the program
+        ldx     #$00
+:       lda     decsrc,x
+        sta     DECOMP,x
+        inx
+        cpx     #declen
+        bne     :-
+
+        ; Move the packed data to the top of memory, highest page first,
+        ; so the program can be unpacked below it without overtaking it
+        stz     src
+        stz     dst
+        lda     #.hibyte(PACKED)-1
+        clc
+        adc     npages
+        sta     src+1
+        lda     #.hibyte(TOP)-1
+        sta     dst+1
+        ldx     npages
+        ldy     #$00
+move:   lda     (src),y
+        sta     (dst),y
+        iny
+        bne     move
+        dec     src+1
+        dec     dst+1
+        dex
+        bne     move
+
+        lda     #.hibyte(TOP)
+        sec
+        sbc     npages
+        sta     src+1
+        lda     #.hibyte(DEST)
+        sta     dst+1
+        jmp     decode
+
+decsrc:
+        .org    DECOMP
+
+decode: lda     (src)
+        jsr     incsrc
+        tax
+        bmi     match
+
+        ; Literal run of X+1 bytes
+        inx
+lit:    lda     (src)
+        sta     (dst)
+        jsr     incsrc
+        jsr     incdst
+        dex
+        bne     lit
+        bra     decode
+
+        ; Copy of an earlier run of bytes, which may overlap dst
+match:  txa
+        and     #$7F
+        clc
+        adc     #$03
+        sta     len
+        lda     (src)
+        sta     ptr
+        jsr     incsrc
+        lda     (src)
+        sta     ptr+1
+        jsr     incsrc
+        ora     ptr
+        beq     done            ; Distance 0 marks the end
+        sec
+        lda     dst
+        sbc     ptr
+        sta     ptr
+        lda     dst+1
+        sbc     ptr+1
+        sta     ptr+1
+        ldx     len
+copy:   lda     (ptr)
+        sta     (dst)
+        inc     ptr
+        bne     :+
+        inc     ptr+1
+:       jsr     incdst
+        dex
+        bne     copy
+        bra     decode
+
+done:   jmp     DEST
+
+incsrc: inc     src
+        bne     :+
+        inc     src+1
+:       rts
+
+incdst: inc     dst
+        bne     :+
+        inc     dst+1
+:       rts
+
+decend:
+        .reloc
+
+declen  =       decend - decode
@@ -6,7 +6,6 @@
  * TODO: Find out why free(usedlist) at end -> crash. Memory corruption?
  * TODO: EOF validation / fix:
  *        1) Check this in readir() taking account of sparse files
- *        2) When trimming a directory, need to update EOF for parent entry
  * TODO: Print indication when a file is sparse - blocks in inverse video?
  * TODO: Get both ProDOS-8 and GNO versions to build from this source
  *
@@ -54,6 +53,20 @@
  * v0.90 Fixed parsing of dateopts[], caseopts[], fixopts[]
  * v0.91 Added disconnect_ramdisk()
  * v0.92 Copied RAMdisk disconnection/reconnection code from EDIT.SYSTEM
+ * v0.93 Visit tree index blocks in ascending order. Optional batching per dir.
+ * v0.94 Scan freelist a block at a time when zeroing. Option to skip zero blks.
+ * v0.95 Only write freelist blocks which have been changed.
+ * v0.96 Enabled TRIMDIR. Update blocks used and EOF in parent entry.
+ * v0.97 Option to move directories to contiguous blocks near the volume dir.
+ * v0.98 Option to move fragmented files to contiguous blocks.
+ * v0.99 Fragmentation and layout analysis report.
+ * v1.00 Job mode - process several paths, or all online volumes, in one run.
+ * v1.01 Checkpoint progress to a file so an interrupted run can be resumed.
+ * v1.02 Optional tab separated report file, written a block at a time.
+ * v1.03 CRC-32 manifest of file contents, with incremental update.
+ * v1.04 Surface scan for unreadable blocks, naming the files affected.
+ * v1.05 Block owner map in aux LC so cross-links name both files.
+ * v1.06 Load startup and end of volume code from overlays.
  */
 
 //#pragma debug 9
@@ -83,9 +96,54 @@
 #define FREELIST    /* Checking of free list */
 #define AUXMEM      /* Auxiliary memory support on //e and up */
 #undef  CMDLINE     /* Command line option parsing */
-#undef TRIMDIR      /* Enable trimming of directory blocks */
+#define TRIMDIR     /* Enable trimming of directory blocks */
+
+#define MOVEDIR     /* Enable moving of directories to contiguous blocks */
+#define MOVEFILE    /* Enable moving of fragmented files */
+#define LAYOUT      /* Fragmentation and layout analysis */
+#define JOBS        /* Multiple start paths / all volumes in one run */
+#define CHECKPOINT  /* Save progress so an interrupted run can resume */
+#define REPORT      /* Machine readable report file */
+#define MANIFEST    /* CRC-32 manifest of file contents */
+#define SURFACE     /* Surface scan for unreadable blocks */
+#define OWNERMAP    /* Record owner of each block to diagnose cross-links */
+#define OVERLAYS    /* Load rarely used code from SORTDIR.OVn files */
+
+#if defined(TRIMDIR) && !defined(FREELIST)
+#error "TRIMDIR requires FREELIST"
+#endif
+#if defined(MOVEDIR) && !defined(TRIMDIR)
+#error "MOVEDIR requires TRIMDIR"
+#endif
+#if defined(MOVEFILE) && !(defined(CHECK) && defined(FREELIST))
+#error "MOVEFILE requires CHECK and FREELIST"
+#endif
+#if defined(LAYOUT) && !(defined(CHECK) && defined(FREELIST))
+#error "LAYOUT requires CHECK and FREELIST"
+#endif
+#if defined(CHECKPOINT) && !defined(FREELIST)
+#error "CHECKPOINT requires FREELIST"
+#endif
+#if defined(REPORT) && !defined(FREELIST)
+#error "REPORT requires FREELIST"
+#endif
+#if defined(MANIFEST) && !(defined(FREELIST) && defined(AUXMEM))
+#error "MANIFEST requires FREELIST and AUXMEM"
+#endif
+#if defined(SURFACE) && !(defined(CHECK) && defined(FREELIST))
+#error "SURFACE requires CHECK and FREELIST"
+#endif
+#if defined(OWNERMAP) && !(defined(CHECK) && defined(FREELIST) && defined(AUXMEM))
+#error "OWNERMAP requires CHECK, FREELIST and AUXMEM"
+#endif
 
 #define NLEVELS 4	/* Number of nested sorts permitted */
+#define MAXPATH 64	/* Maximum length of ProDOS pathname */
+#define CKPTDIRS 8	/* Directories processed between checkpoints */
+#define MAXBAD 32	/* Unreadable blocks recorded by surface scan */
+#define NRETRY 4	/* Retries for each unreadable block */
+#define OWNMAPBLKS 2048	/* Blocks covered by owner map, 3 bytes each */
+#define IOSLACK 1280	/* Heap kept free for each open file's I/O buffer */
 
 typedef unsigned char uchar;
 typedef unsigned int  uint;
@@ -178,6 +236,116 @@ struct fileent {
 	uint  order;             /* Hack to make qsort() stable */
 };
 
+#ifdef CHECK
+/*
+ * Entry for list of tree file sub-index blocks awaiting a batched read
+ * Shares storage with filelist[], which is not used until sorting begins
+ */
+struct idxblk {
+	uint  blocknum;          /* Block number of sub-index block */
+	uint  count;             /* Blocks counted, once it has been read */
+	uchar blockidx;          /* Index of dir block holding file entry */
+	uchar entrynum;          /* Entry within the block */
+};
+#endif
+
+#ifdef LAYOUT
+/*
+ * Layout statistics for the blocks of a file or directory, which are
+ * passed to layoutblk() in the order they are read
+ */
+struct layout {
+	uint  prev;              /* Previous block number */
+	uint  blks;              /* Number of blocks */
+	uint  extents;           /* Number of runs of contiguous blocks */
+	ulong seek;              /* Sum of distances between blocks */
+};
+
+/*
+ * Entry for the list of the most fragmented files and directories
+ */
+#define NWORST 8
+struct worst {
+	char  name[NMLEN+1];     /* File or directory name */
+	uint  dirblk;            /* Key block of directory containing it */
+	uint  extents;           /* Number of runs of contiguous blocks */
+	uint  avgseek;           /* Average distance between blocks */
+};
+#endif
+
+#ifdef JOBS
+/*
+ * Entry for list of start paths to process in one run
+ * A path of "*" means all online volumes, "@file" means read paths from file
+ */
+struct target {
+	char          path[MAXPATH+1]; /* Start path */
+	uchar         done;            /* 1 once processed */
+	uint          errs;            /* Errors found */
+	struct target *next;
+};
+#endif
+
+#ifdef CHECKPOINT
+/*
+ * Header of checkpoint file.  It is followed by ndirs keyblock numbers
+ * of directories still to be processed, then the usedlist and, if
+ * flchanged is non-zero, the freelist.
+ */
+struct ckpt {
+	char  magic[4];          /* "SDC2" */
+	char  path[MAXPATH+1];   /* Start path */
+	char  volname[NMLEN+1];  /* Volume name, checked on resume */
+	uint  totblks;           /* Volume size, checked on resume */
+	uint  errcount;          /* Errors so far */
+	uint  errstart;          /* Errors before this start path */
+	uint  ndirs;             /* Number of directories pending */
+	uint  flchanged;         /* Changed freelist blocks, 0 if not saved */
+	uchar dowholedisk;
+	uchar dorecurse;
+	uchar dowrite;
+	uchar dobatch;
+	uchar dolayout;
+	uchar domovedirs;
+	uchar domovefiles;
+	uchar dozero;
+	uchar dosurface;
+	uchar dohash;
+	char  sortopts[NLEVELS+1];
+	char  caseopts[2];
+	char  fixopts[2];
+	char  dateopts[2];
+	char  mfdir[MAXPATH+1];  /* Manifest directory */
+	uint  nbad;              /* Unreadable blocks found by surface scan */
+	uint  badblks[MAXBAD];
+};
+#endif
+
+#ifdef MANIFEST
+/*
+ * Manifest file header.  It is followed by a struct mfgroup for each
+ * directory, each followed by a struct mfrec for each file.
+ */
+struct mfhdr {
+	char  magic[4];          /* "SDM2" */
+	char  volname[NMLEN+1];  /* Volume name */
+	uint  totblks;           /* Volume size */
+};
+
+struct mfgroup {
+	uint  dirblk;            /* Key block of directory */
+	uint  count;             /* Number of struct mfrec following */
+};
+
+struct mfrec {
+	uchar namecrc[4];        /* CRC-32 of file name, to match it by */
+	uchar mtime[4];          /* Modification time when hashed */
+	uchar eof[3];            /* EOF when hashed */
+	uchar blksused[2];       /* Blocks used when hashed */
+	uchar crc[4];            /* CRC-32 of file contents, LSB first */
+};
+#endif
+
 /*
  * Entry for list of directory keyblocks to check
  */
@@ -210,42 +378,137 @@ struct datetime {
 static char *auxp     = (char*)STARTAUX1;    /* For allocating aux main */
 static char *auxp2    = (char*)STARTAUX2;    /* For allocating aux LC */
 static char *auxlockp = (char*)STARTAUX1;    /* Aux mem protection */
+static char *auxlockp2 = (char*)STARTAUX2;   /* Aux LC mem protection */
 #endif
 #ifdef FREELIST
 static uint totblks;                     /* Total # blocks on volume */
 static uchar *freelist;                  /* Free-list bitmap */
 static uchar *usedlist;                  /* Bit map of used blocks */
 static uchar flloaded = 0;               /* 1 if free-list has been loaded */
-static uchar flchanged = 0;              /* 1 if free-list has been changed */
+static uint flchanged = 0;               /* Bitmap of changed free-list blks */
+static uint flwritten = 0;               /* Num free-list blocks written */
 static uint flsize;                      /* Size of free-list in blocks */
 static uint flblk;                       /* Block num for start of freelist */
+static char volname[NMLEN+1];            /* Name of volume being processed */
 #endif
 static char currdir[NMLEN+1];            /* Name of current directory */
 static struct block *blocks = NULL;      /* List of directory disk blocks */
 static struct dirblk *dirs = NULL;       /* List of key blocks of subdirs */
+#ifdef JOBS
+static struct target *targets = NULL;    /* List of start paths */
+#endif
+#ifdef MOVEDIR
+static uint relocblk = 0;                /* New key blk if moving dir, or 0 */
+#endif
+#ifdef CHECK
+static struct idxblk *idxlist;           /* Queue of tree sub-index blks */
+static uint numidx;                      /* Number of entries in idxlist[] */
+static uint maxidx;                      /* Size of idxlist[] */
+#endif
 static uint numfiles;                    /* Number of files in current dir */
 static uint maxfiles;                    /* Size of filelist[] */
 static uchar entsz;                      /* Bytes per file entry */
 static uchar entperblk;                  /* Number of entries per block */
 static uint errcount = 0;                /* Error counter */
+static uint errstart = 0;                /* errcount when target started */
 static dhandle_t dio_hdl;                /* cc64 direct I/O handle */
 static uchar dowholedisk = 0;            /* -D whole-disk option */
 static uchar dorecurse = 0;              /* -r recurse option */
 static uchar dowrite = 0;                /* -w write option */
 static uchar doverbose = 0;              /* -v verbose option */
 static uchar dodebug = 0;                /* -V very verbose option */
+#ifdef CHECK
+static uchar dobatch = 0;                /* -b batch tree index reads */
+#endif
+#ifdef MOVEDIR
+static uchar domovedirs = 0;             /* -m move dirs option */
+#endif
+#ifdef LAYOUT
+static uchar dolayout = 0;               /* -l layout analysis option */
+static struct layout filelayout;         /* Layout of current file */
+static struct layout dirlayout;          /* Layout of current directory */
+static struct layout *curlayout = NULL;  /* Where checkblock() records */
+static ulong lytblks = 0;                /* Total blocks analysed */
+static ulong lytextents = 0;             /* Total extents */
+static ulong lytseek = 0;                /* Total seek distance */
+static uint lytobjs = 0;                 /* Files and dirs analysed */
+static uint lytfrag = 0;                 /* Files and dirs fragmented */
+static struct worst worstlist[NWORST];   /* Most fragmented, worst first */
+#endif
+#ifdef MOVEFILE
+static uchar domovefiles = 0;            /* -M move files option */
+static uchar mvcopy;                     /* 0 survey, 1 copy, 2 release */
+static uchar mvcontig;                   /* 1 if file blocks are contiguous */
+static uint  mvnext;                     /* Next block in layout order */
+static uint  mvcount;                    /* Number of blocks in file */
+#endif
 #ifdef FREELIST
-static uchar dozero = 0;                 /* -z zero free blocks option */
+static uchar dozero = 0;                 /* -z/-Z zero free blocks option */
 #endif
 static char sortopts[NLEVELS+1] = "";    /* -s:abc list of sort options */
 static char caseopts[2] = "";            /* -c:x case conversion option */
 static char fixopts[2] = "";             /* -f:x fix mode option */
 static char dateopts[2] = "";            /* -d:x date conversion option */
+#ifdef CHECKPOINT
+static char ckptpath[MAXPATH+1] = "";    /* -c checkpoint file, or empty */
+static struct ckpt ckpt;                 /* Checkpoint file header */
+static uchar doresume = 0;               /* 1 to resume from checkpoint */
+#endif
+#ifdef REPORT
+static char rptpath[MAXPATH+1] = "";     /* -o report file, or empty */
+static char rptabs[MAXPATH+1];           /* Absolute path of report file */
+static uint rptdirlen;                   /* Length of dir part of rptabs */
+static int rptfd = -1;                   /* Report file descriptor */
+static uint rptlen = 0;                  /* Bytes used in rptbuf */
+static uchar rptonvol = 0;               /* 1 if report on volume processed */
+static char rptdirpath[MAXPATH+1];       /* Path of current directory */
+static char rptline[128];                /* Report line being formatted */
+static uint fixcount = 0;                /* Number of fixes applied */
+static uint wrtcount = 0;                /* Number of blocks written */
+#endif
+#ifdef MANIFEST
+static uchar dohash = 0;                 /* -k/-K 1 update, 2 verify all */
+static char mfdir[MAXPATH+1] = "";       /* Directory holding manifests */
+static char mfname[MAXPATH+NMLEN+2];     /* Manifest for this volume */
+static char mftmp[MAXPATH+NMLEN+2];      /* New manifest being written */
+static int mfold = -1;                   /* Old manifest file descriptor */
+static int mfnew = -1;                   /* New manifest file descriptor */
+static char *mfbuf;                      /* Block buffer for new manifest */
+static uint mflen;                       /* Bytes used in mfbuf */
+static long mfgrppos;                    /* Offset of last group written */
+static char *crcaux;                     /* CRC-32 tables in aux mem */
+static uchar *crctab;                    /* Copy of CRC-32 tables in main */
+static uchar crc[4];                     /* CRC being calculated */
+static uint mfhashed;                    /* Files hashed */
+static uint mfsame;                      /* Files unchanged, not hashed */
+static uint mfbad;                       /* Files with CRC mismatch */
+#endif
+#ifdef SURFACE
+static uchar dosurface = 0;              /* -S surface scan option */
+static uint badblks[MAXBAD];             /* Unreadable blocks, ascending */
+static uint nbad = 0;                    /* Number of entries in badblks[] */
+static char *ownername = "";             /* Owner of blks checkblock() sees */
+#endif
+#ifdef OWNERMAP
+static char *ownmap;                     /* Owner of each block, in aux LC */
+static char *ownbuf;                     /* For reading owner's dir block */
+static uint ownblk;                      /* Dir blk holding entry of owner */
+static uchar ownent;                     /* Entry number of owner in ownblk */
+#endif
+#ifdef OVERLAYS
+static char ovlpath[MAXPATH+1];          /* Path of overlay file */
+static uchar ovldirlen;                  /* Length of dir part of ovlpath */
+extern char _OVERLAY1_LOAD__[], _OVERLAY1_SIZE__[];
+extern char _OVERLAY2_LOAD__[], _OVERLAY2_SIZE__[];
+#endif
 
 // Allocated dynamically in main()
 static char *buf;                        /* General purpose scratch buffer */
 static char *buf2;                       /* General purpose scratch buffer */
 static char *dirblkbuf;                  /* Used for reading directory blocks */
+#ifdef REPORT
+static char *rptbuf;                     /* Report file block buffer */
+#endif
 static struct fileent *filelist;         /* Used for qsort() */
 
 /* Error messages */
@@ -270,6 +533,7 @@ static const char err_hdrblk2[]  = "Bad hdr blk %u, should be %u";
 static const char err_access[]   = "Bad access";
 static const char err_forksz3[]  = "%s fork size %u is wrong, should be %u";
 static const char err_used2[]    = "Blks used %u is wrong, should be %u";
+static const char err_used3[]    = "%s blks used %u is wrong, should be %u";
 #endif
 static const char err_many[]     = "Too many files to sort";
 static const char err_count2[]   = "Filecount %u wrong, should be %u";
@@ -280,12 +544,52 @@ static const char err_blfree1[]  = "In use blk %u is marked free";
 static const char err_blfree2[]  = "%s blk %u marked free";
 static const char err_blused1[]  = "Unused blk %u not marked free";
 static const char err_blused2[]  = "%s blk %u used elsewhere";
+#ifdef OWNERMAP
+static const char err_blused3[]  = "%s blk %u of %s also used by %s";
+#endif
 #endif
 static const char err_updsdir1[] = "Can't update subdir entry (%s)";
+#ifdef TRIMDIR
+static const char err_updpar1[]  = "Can't update parent entry (%s)";
+#endif
+#ifdef MOVEDIR
+static const char err_nomove[]   = "Not moving dir due to errors";
+#endif
+#ifdef MOVEFILE
+static const char err_nomvfile[] = "Not moving files due to errors";
+#endif
 static const char err_invopt[]   = "Invalid %s option";
 #ifdef CMDLINE
 static const char err_usage[]    = "Usage error";
 #endif
+#ifdef JOBS
+static const char err_job1[]     = "Can't open job file %s";
+#endif
+#ifdef CHECKPOINT
+static const char err_ckpt1[]    = "Can't write checkpoint %s";
+static const char err_ckpt2[]    = "Can't read checkpoint %s";
+static const char err_ckpt3[]    = "Checkpoint is for another volume";
+static const char err_ckpt4[]    = "Checkpoint must be on another volume";
+#endif
+#ifdef REPORT
+static const char err_rpt1[]     = "Can't write report %s";
+static const char err_rptdir[]   = "Not sorting dir containing report file";
+static const char err_rptvol[]   = "Report file on this volume: not moving, zeroing or writing free list";
+#endif
+#ifdef MANIFEST
+static const char err_crc1[]     = "%s CRC mismatch, contents may be corrupt";
+static const char err_mf1[]      = "Manifest must be on another volume";
+static const char err_mf2[]      = "Ignoring old manifest %s";
+static const char err_mf3[]      = "Can't write manifest %s";
+static const char err_mf4[]      = "Can't resume manifest in %s, not updated";
+#endif
+#ifdef SURFACE
+static const char err_bad1[]     = "Too many unreadable blks, only %u recorded";
+static const char err_bad2[]     = "%s blk %u is unreadable %s";
+#endif
+#ifdef OVERLAYS
+static const char err_ovl[]      = "Can't load %s";
+#endif
 static const char err_80col[]    = "Need 80 cols";
 static const char err_128K[]     = "Need 128K";
 
@@ -309,6 +613,7 @@ void confirm(void);
 void err(enum errtype severity, const char *fmt, ...);
 void flushall(void);
 int  readdiskblock(uchar device, uint blocknum, char *buf);
+uchar isprotected(void);
 int  writediskblock(uchar device, uint blocknum, char *buf);
 void fixcase(char *in, char *out, uchar vers, uchar minvers, uchar len);
 void lowercase(char *p, uchar len, uchar *vers, uchar *minvers);
@@ -321,20 +626,48 @@ void printdatetime(struct datetime *dt);
 uint askfix(void);
 #ifdef FREELIST
 int  readfreelist(uchar device);
+uchar onvolume(char *path);
 int  isfree(uint blk);
 int  isused(uint blk);
 void markused(uint blk);
 void trimdirblock(uint blk);
+void allocblock(uint blk);
+uint findfreerun(uint n);
 void checkblock(uint blk, char *msg);
 #endif
+#ifdef OWNERMAP
+void  setowner(uint blk);
+char  *ownername2(uint dirblk, uchar entry, char *name);
+int   crosslink(uint blk, char *msg);
+#endif
+#ifdef LAYOUT
+void layoutblk(struct layout *l, uint blk);
+void layoutdone(struct layout *l, char *name, uint dirblk);
+void printlayout(void);
+#endif
 #ifdef CHECK
 int  seedlingblocks(uchar device, uint keyblk, uint *blkcnt);
 int  saplingblocks(uchar device, uint keyblk, uint *blkcnt);
-int  treeblocks(uchar device, uint keyblk, uint *blkcnt);
+uint sortindexblk(char *p);
+int  treeblocks(uchar device, uint keyblk, uchar blkidx, uchar entry,
+                uint *blkcnt);
+int  cmp_idxblk_blk(const void *a, const void *b);
+int  cmp_idxblk_ent(const void *a, const void *b);
+void flushidxblks(uchar device);
 int  forkblocks(uchar device, uint keyblk, uint *blkcnt);
 int  subdirblocks(uchar device, uint keyblk, struct pd_dirent *ent,
                   uint blocknum, uint blkentries, uint *blkcnt);
 #endif
+#ifdef MOVEFILE
+uint mvreserve(uint blk);
+void mvcommit(uchar device, uint blk, uint newblk, char *data);
+uint mvblock(uchar device, uint blk);
+uint mvsapling(uchar device, uint keyblk, char *idxbuf);
+uint mvtree(uchar device, uint keyblk);
+uint mvfork(uchar device, uint keyblk);
+uint mvfile(uchar device, uchar type, uint keyblk);
+void movefiles(uchar device);
+#endif
 void enqueuesubdir(uint blocknum, uint subdiridx);
 int  readdir(uint device, uint blocknum);
 #ifdef SORT
@@ -360,22 +693,72 @@ void  printlist(void);
 uint  blockidxtoblocknum(uint idx);
 void  copydirblkptrs(uint blkidx);
 void  copydirent(uint srcblk, uint srcent, uint dstblk, uint dstent, uint device);
-uchar sortblock(uint device, uint dstblk);
+uchar sortblock(uint device, uint dstblk, uint lastblk);
+#ifdef TRIMDIR
+uchar updateparent(uchar device, uint blks);
+#endif
 uchar writedir(uchar device);
 uchar writefreelist(uchar device);
 void  freeblocks(void);
 void  subtitle(char *s);
 void  interactive(void);
 void  processdir(uint device, uint blocknum);
+void  processtarget(char *path);
+#ifdef JOBS
+struct target *addtarget(struct target *after, char *path);
+uchar unittodev(uchar unit);
+void  addvolumes(struct target *t);
+void  readjobfile(struct target *t);
+void  processjobs(void);
+#endif
+#ifdef CHECKPOINT
+int   ckptaux(int fd, uchar *p, uchar save);
+int   savecheckpoint(char *path);
+uchar askresume(void);
+int   restorecheckpoint(uchar device);
+#endif
+#ifdef REPORT
+void  rptopen(void);
+void  rptflush(void);
+void  rptclose(void);
+void  rptputs(char *s);
+void  rpterr(const char *fmt, va_list v);
+void  rptdir(uint errs, uint fixes, uint wrts);
+void  dirpath(uchar device, uint blk, char *p);
+#endif
+#ifdef MANIFEST
+void  crcinit(void);
+void  crcblock(uchar *p, uint len);
+int   crcsapling(uchar device, char *idx, ulong *left);
+int   crcfork(uchar device, uchar type, uint keyblk, ulong eof);
+int   crcfile(uchar device, struct pd_dirent *ent);
+void  mfopen(void);
+void  mfput(void *p, uint len);
+void  mfflush(void);
+uint  mfload(uint dirblk, struct mfrec *recs, uint max);
+uchar ishashable(uchar type);
+void  hashdir(uchar device, uint dirblk);
+void  mfmoved(uint dirblk);
+void  mfclose(void);
+#endif
+#ifdef SURFACE
+uchar isbad(uint blk);
+void  surfacescan(void);
+void  surfacedone(void);
+#endif
 #ifdef FREELIST
 void  checkfreeandused(uchar device);
-void  zeroblock(uchar device, uint blocknum);
+uchar zeroblock(uchar device, uint blocknum);
 void  zerofreeblocks(uchar device, uint freeblks);
 #endif
 #ifdef CMDLINE
 void  usage(void);
 void  parseargs(void);
 #endif
+#ifdef OVERLAYS
+void  findoverlays(void);
+void  loadoverlay(uchar n);
+#endif
 
 enum errtype {WARN, NONFATAL, FATAL, FATALALLOC, FATALBADARG, FINISHED};
 
@@ -423,12 +806,13 @@ char *auxalloc2(uint bytes) {
  */
 void lockaux(void) {
 	auxlockp = auxp;
+	auxlockp2 = auxp2;
 }
 
 /* Free all aux memory above lock address */
 void freeallaux() {
 	auxp = (char*)auxlockp;
-	auxp2 = (char*)STARTAUX2;
+	auxp2 = (char*)auxlockp2;
 }
 
 #endif
@@ -469,9 +853,12 @@ void err(enum errtype severity, const char *fmt, ...) {
 			printf("DONE - no errors found.\n");
 		else
 			printf("DONE - %u errors\n", errcount);
+#ifdef FREELIST
+		if (flloaded)
+			printf("Wrote %u of %u freelist blks\n", flwritten, flsize);
+#endif
 		hline();
-		confirm();
-		exit(EXIT_SUCCESS);
+		goto quit;	/* rv is EXIT_SUCCESS */
 	}
 	++errcount;
 
@@ -488,8 +875,17 @@ void err(enum errtype severity, const char *fmt, ...) {
 	va_start(v, fmt);
 	vprintf(fmt, v);
 	va_end(v);
+#ifdef REPORT
+	va_start(v, fmt);
+	rpterr(fmt, v);
+	va_end(v);
+#endif
 	if (rv > 0) {
 		printf("\nStopping after %u errors\n", errcount);
+quit:
+#ifdef REPORT
+		rptclose();
+#endif
 		confirm();
 		exit(rv);
 	}
@@ -519,6 +915,11 @@ int readdiskblock(uchar device, uint blocknum, char *buf) {
 			err(NONFATAL, err_blfree1, blocknum);
 #endif
 #endif
+#ifdef SURFACE
+	/* Already reported by surface scan, let the caller carry on */
+	if (nbad && isbad(blocknum))
+		return -1;
+#endif
 //	BlockRec br;
 //	br.blockDevNum = device;
 //	br.blockDataBuffer = buf;
@@ -535,14 +936,21 @@ int readdiskblock(uchar device, uint blocknum, char *buf) {
 	return 0;
 }
 
+/*
+ * Returns 1 if the current directory must never be written, 0 otherwise
+ */
+uchar isprotected(void) {
+	return ((strcmp(currdir, "LIB") == 0) ||
+	        (strcmp(currdir, "LIBRARIES") == 0));
+}
+
 /*
  * Write block from disk using ProDOS call
  * buf must point to buffer with at least 512 bytes
  */
 int writediskblock(uchar device, uint blocknum, char *buf) {
 	int rc;
-	if ((strcmp(currdir, "LIB") == 0) ||
-	    (strcmp(currdir, "LIBRARIES") == 0)) {
+	if (isprotected()) {
 		printf("Not writing lib dir %s\n", currdir);
 		return 0;
 	}
@@ -562,6 +970,9 @@ int writediskblock(uchar device, uint blocknum, char *buf) {
 	rc = dio_write(dio_hdl, blocknum, buf);
 	if (rc)
 		err(FATAL, err_wtblk2, blocknum, rc);
+#ifdef REPORT
+	++wrtcount;
+#endif
 	return 0;
 }
 
@@ -842,19 +1253,38 @@ uint askfix(void) {
 	switch (fixopts[0]) {
 	case '-':
 		if (tolower(getchar()) == 'y')
-			return 1;
+			break;
 		return 0;
 	case 'y':
 		fputs("y", stdout);
-		return 1;
+		break;
 	default:
 		fputs("n", stdout);
 		return 0;
 	}
+#ifdef REPORT
+	++fixcount;
+#endif
+	return 1;
 }
 
 #ifdef FREELIST
 
+/*
+ * Returns 1 if path may be on the volume being processed, 0 otherwise.
+ * A relative path is assumed to be on it, as it may resolve there.
+ */
+uchar onvolume(char *path) {
+	char *p;
+	uint len;
+	if (path[0] != '/')
+		return 1;
+	p = strchr(path + 1, '/');
+	len = (p ? p - path - 1 : strlen(path + 1));
+	return ((len == strlen(volname)) &&
+	        (strncasecmp(path + 1, volname, len) == 0));
+}
+
 /*
  * Read the free list
  */
@@ -867,10 +1297,16 @@ int readfreelist(uchar device) {
 		copyaux(buf, freelist + i * BLKSZ, BLKSZ, TOAUX);
 		copyaux(buf, usedlist + i * BLKSZ, BLKSZ, TOAUX);
 	}
+#ifdef OWNERMAP
+	for (i = 0; i < OWNMAPBLKS * 3 / BLKSZ; ++i)
+		copyaux(buf, ownmap + i * BLKSZ, BLKSZ, TOAUX);
+#endif
 #else
 	bzero(freelist, FLSZ);
 	bzero(usedlist, FLSZ);
 #endif
+	flchanged = 0;
+	flwritten = 0;
 	markused(0); /* Boot block */
 	markused(1); /* SOS boot block */
 	if (readdiskblock(device, 2, buf) == -1) {
@@ -879,6 +1315,8 @@ int readfreelist(uchar device) {
 	}
 	flblk = f = buf[0x27] + 256U * buf[0x28];
 	totblks = buf[0x29] + 256U * buf[0x2a];
+	bzero(volname, NMLEN+1);
+	memcpy(volname, buf + 5, buf[4] & 0x0f);
 	if (doverbose)
 		printf("Volume has %u blocks\n", totblks);
 	flsize = totblks / 4096U;
@@ -968,7 +1406,67 @@ void trimdirblock(uint blk) {
 	usedlist[idx] &= ~(0x80 >> bit);
 	freelist[idx] |= (0x80 >> bit);
 #endif
-	flchanged = 1;
+	flchanged |= (1U << (idx / BLKSZ));
+}
+
+/*
+ * Mark a block as used and remove it from freelist
+ */
+void allocblock(uint blk) {
+	uchar temp;
+	uint idx = blk / 8;
+	uint bit = blk % 8;
+#ifdef AUXMEM
+	copyaux(freelist + idx, &temp, 1, FROMAUX);
+	temp &= ~(0x80 >> bit);
+	copyaux(&temp, freelist + idx, 1, TOAUX);
+#else
+	freelist[idx] &= ~(0x80 >> bit);
+#endif
+	flchanged |= (1U << (idx / BLKSZ));
+	markused(blk);
+}
+
+/*
+ * Find the lowest run of n contiguous blocks which are marked free and
+ * have not been seen in use by any file or directory.
+ * Uses buf[] and buf2[].
+ * Returns first block of the run, or 0 if there is no run long enough.
+ */
+uint findfreerun(uint n) {
+	uint i, blk = 0, start = 0, len = 0;
+	uchar b, fl, bit;
+	for (b = 0; b < flsize; ++b) {
+#ifdef AUXMEM
+		copyaux(freelist + b * BLKSZ, buf, BLKSZ, FROMAUX);
+		copyaux(usedlist + b * BLKSZ, buf2, BLKSZ, FROMAUX);
+#else
+		memcpy(buf, freelist + b * BLKSZ, BLKSZ);
+		memcpy(buf2, usedlist + b * BLKSZ, BLKSZ);
+#endif
+		for (i = 0; i < BLKSZ; ++i) {
+			fl = buf[i] & ~buf2[i];
+			if (fl == 0) {
+				/* No free blocks in this byte */
+				len = 0;
+				blk += 8;
+				continue;
+			}
+			for (bit = 0; bit < 8; ++bit) {
+				if (blk >= totblks)
+					return 0;
+				if ((fl << bit) & 0x80) {
+					if (len == 0)
+						start = blk;
+					if (++len == n)
+						return start;
+				} else
+					len = 0;
+				++blk;
+			}
+		}
+	}
+	return 0;
 }
 
 /*
@@ -979,11 +1477,198 @@ void trimdirblock(uint blk) {
 void checkblock(uint blk, char *msg) {
 	if (isfree(blk))
 		err(WARN, err_blfree2, msg, blk);
-	if (isused(blk))
+	if (isused(blk)) {
+#ifdef OWNERMAP
+		if (crosslink(blk, msg) == -1)
+#endif
 		err(WARN, err_blused2, msg, blk);
+	}
+#ifdef OWNERMAP
+	else
+		setowner(blk);
+#endif
+#ifdef SURFACE
+	if (nbad && isbad(blk))
+		err(NONFATAL, err_bad2, msg, blk, ownername);
+#endif
 	markused(blk);
+#ifdef LAYOUT
+	if (curlayout)
+		layoutblk(curlayout, blk);
+#endif
+}
+
+#endif
+
+#ifdef OWNERMAP
+
+/*
+ * Record the current owner (ownblk, ownent) of block blk in the owner map.
+ * Each entry is the directory block holding the owner's entry (2 bytes)
+ * and the entry number within that block, as in a ProDOS parent pointer.
+ * Blocks beyond OWNMAPBLKS are not recorded.
+ */
+void setowner(uint blk) {
+	uchar id[3];
+	if (blk >= OWNMAPBLKS)
+		return;
+	id[0] = ownblk & 0xff;
+	id[1] = (ownblk >> 8) & 0xff;
+	id[2] = ownent;
+	copyaux((char*)id, ownmap + blk * 3, 3, TOAUX);
+}
+
+/*
+ * Read the name from entry number entry of directory block dirblk into
+ * name, which must be NMLEN+1 bytes.  Uses ownbuf.  Returns name.
+ */
+char *ownername2(uint dirblk, uchar entry, char *name) {
+	struct pd_dirent *ent;
+	strcpy(name, "?");
+	if ((entry == 0) || (entry > ENTPERBLK) ||
+	    dio_read(dio_hdl, dirblk, ownbuf))
+		return name;
+	ent = (struct pd_dirent*)(ownbuf + PTRSZ + (entry - 1) * ENTSZ);
+	bzero(name, NMLEN+1);
+	memcpy(name, ent->name, ent->typ_len & 0x0f);
+	return name;
+}
+
+/*
+ * Report block blk of the current owner, which msg describes, as
+ * cross-linked with the owner recorded in the owner map.
+ * Returns -1 if there is no record of the other owner, 0 otherwise.
+ */
+int crosslink(uint blk, char *msg) {
+	static char name1[NMLEN+1], name2[NMLEN+1];
+	uchar id[3];
+	if (blk >= OWNMAPBLKS)
+		return -1;
+	copyaux(ownmap + blk * 3, (char*)id, 3, FROMAUX);
+	if (id[2] == 0)
+		return -1;
+	err(WARN, err_blused3, msg, blk,
+	    ownername2(ownblk, ownent, name1),
+	    ownername2(id[0] + 256U * id[1], id[2], name2));
+	return 0;
+}
+
+#endif
+
+#ifdef LAYOUT
+
+/*
+ * Record the next block of a file or directory in layout statistics l
+ */
+void layoutblk(struct layout *l, uint blk) {
+	if (l->blks > 0) {
+		l->seek += (blk > l->prev) ? blk - l->prev : l->prev - blk;
+		if (blk != l->prev + 1)
+			++l->extents;
+	} else
+		l->extents = 1;
+	l->prev = blk;
+	++l->blks;
+}
+
+/*
+ * Finish the layout statistics for a file or directory.  Adds them to the
+ * volume totals, prints a line if fragmented and updates worstlist[].
+ * Resets l ready for the next file or directory.
+ */
+void layoutdone(struct layout *l, char *name, uint dirblk) {
+	uint avgseek, i, j;
+	if (l->blks == 0)
+		return;
+	avgseek = (l->blks > 1) ? l->seek / (l->blks - 1) : 0;
+	++lytobjs;
+	lytblks += l->blks;
+	lytextents += l->extents;
+	lytseek += l->seek;
+	if (l->extents > 1) {
+		++lytfrag;
+		printf("  %s: %u blks in %u extents, avg seek %u\n",
+		       name, l->blks, l->extents, avgseek);
+		for (i = 0; i < NWORST; ++i)
+			if (l->extents > worstlist[i].extents)
+				break;
+		if (i < NWORST) {
+			for (j = NWORST - 1; j > i; --j)
+				worstlist[j] = worstlist[j-1];
+			strncpy(worstlist[i].name, name, NMLEN);
+			worstlist[i].name[NMLEN] = '\0';
+			worstlist[i].dirblk = dirblk;
+			worstlist[i].extents = l->extents;
+			worstlist[i].avgseek = avgseek;
+		}
+	}
+	bzero(l, sizeof(struct layout));
+}
+
+#ifdef OVERLAYS
+#pragma code-name (push, "OVERLAY2")
+#pragma rodata-name (push, "OVERLAY2")
+#endif
+/*
+ * Print the volume-wide layout report, then reset the totals
+ * The fragmentation index is the percentage of steps from one block of a
+ * file or directory to the next which are not to the following block.
+ */
+void printlayout(void) {
+	uint i, blk = 0, run = 0, maxrun = 0, freeruns = 0;
+	uchar b, fl, bit;
+	ulong steps = lytblks - lytobjs;
+
+	/* Find the largest run of free blocks in the freelist */
+	for (b = 0; b < flsize; ++b) {
+#ifdef AUXMEM
+		copyaux(freelist + b * BLKSZ, buf, BLKSZ, FROMAUX);
+#else
+		memcpy(buf, freelist + b * BLKSZ, BLKSZ);
+#endif
+		for (i = 0; (i < BLKSZ) && (blk < totblks); ++i) {
+			fl = buf[i];
+			for (bit = 0; (bit < 8) && (blk < totblks); ++bit) {
+				if ((fl << bit) & 0x80) {
+					if (run++ == 0)
+						++freeruns;
+					if (run > maxrun)
+						maxrun = run;
+				} else
+					run = 0;
+				++blk;
+			}
+		}
+	}
+
+	putchar('\n');
+	hlinechar('=');
+	puts("Layout analysis");
+	hline();
+	printf("Files and dirs %u, fragmented %u\n", lytobjs, lytfrag);
+	printf("Blocks %lu in %lu extents", lytblks, lytextents);
+	if (steps > 0)
+		printf(", avg seek %lu, frag index %lu%%",
+		       lytseek / steps, ((lytextents - lytobjs) * 100) / steps);
+	printf("\nFree space in %u runs, largest %u blks\n", freeruns, maxrun);
+	if (worstlist[0].extents > 0) {
+		puts("Most fragmented:      Extents  Avg seek  Dir blk");
+		for (i = 0; (i < NWORST) && (worstlist[i].extents > 0); ++i)
+			printf("  %-18s  %7u  %8u  %7u\n",
+			       worstlist[i].name, worstlist[i].extents,
+			       worstlist[i].avgseek, worstlist[i].dirblk);
+	}
+
+	/* Reset for the next volume */
+	lytblks = lytextents = lytseek = 0;
+	lytobjs = lytfrag = 0;
+	bzero(worstlist, sizeof(worstlist));
 }
 
+#ifdef OVERLAYS
+#pragma code-name (pop)
+#pragma rodata-name (pop)
+#endif
 #endif
 
 #ifdef CHECK
@@ -1026,11 +1711,50 @@ int saplingblocks(uchar device, uint keyblk, uint *blkcnt) {
 	return 0;
 }
 
+/*
+ * Move the non-zero block pointers in index block p[] to the start of the
+ * block and sort them into ascending order, so they can be visited in a
+ * single sweep across the disk.  The LSB of each pointer is in p[0..255]
+ * and the MSB in p[256..511].  Returns the number of non-zero pointers.
+ */
+uint sortindexblk(char *p) {
+	uint i, j, n = 0, blk;
+	uchar lo, hi;
+	for (i = 0; i < 256; ++i) {
+		if (p[i] || p[i+256]) {
+			p[n] = p[i];
+			p[n+256] = p[i+256];
+			++n;
+		}
+	}
+	/* Insertion sort - index blocks are short and usually almost sorted */
+	for (i = 1; i < n; ++i) {
+		lo = p[i];
+		hi = p[i+256];
+		blk = lo + 256U * hi;
+		for (j = i; j > 0; --j) {
+			if (p[j-1] + 256U * p[j-1+256] <= blk)
+				break;
+			p[j] = p[j-1];
+			p[j+256] = p[j-1+256];
+		}
+		p[j] = lo;
+		p[j+256] = hi;
+	}
+	return n;
+}
+
 /*
  * Count the blocks in a tree file
+ * The sub-index blocks are visited in ascending order of block number.
+ * If batching is enabled, blkidx and entry identify the directory entry
+ * and the sub-index blocks are queued for flushidxblks(), in which case
+ * *blkcnt is set to 0.  blkidx of 0 means do not batch, which is also
+ * used for entries beyond the 255th block of a directory.
  */
-int treeblocks(uchar device, uint keyblk, uint *blkcnt) {
-	uint i, p, b;
+int treeblocks(uchar device, uint keyblk, uchar blkidx, uchar entry,
+               uint *blkcnt) {
+	uint i, n, p, b;
 #ifdef FREELIST
 	checkblock(keyblk, "Tree index");
 #endif
@@ -1039,18 +1763,131 @@ int treeblocks(uchar device, uint keyblk, uint *blkcnt) {
 		return -1;
 	}
 	*blkcnt = 1;
-	for (i = 0; i < 256; ++i) {
-		p = buf2[i] + 256U * buf2[i+256];
-		if (p) {
-			if (saplingblocks(device, p, &b) == 0)
-				*blkcnt += b;
-			else
-				return -1;
+#ifdef LAYOUT
+	/* Layout analysis needs the blocks in file order */
+	if (dolayout) {
+		for (i = 0; i < 256; ++i) {
+			p = buf2[i] + 256U * buf2[i+256];
+			if (p) {
+				if (saplingblocks(device, p, &b) == 0)
+					*blkcnt += b;
+				else
+					return -1;
+			}
+		}
+		return 0;
+	}
+#endif
+	n = sortindexblk(buf2);
+	if (dobatch && blkidx && n && (numidx + n <= maxidx)) {
+		for (i = 0; i < n; ++i) {
+			idxlist[numidx].blocknum = buf2[i] + 256U * buf2[i+256];
+			idxlist[numidx].blockidx = blkidx;
+			idxlist[numidx].entrynum = entry;
+			++numidx;
 		}
+		*blkcnt = 0;
+		return 0;
+	}
+	for (i = 0; i < n; ++i) {
+		p = buf2[i] + 256U * buf2[i+256];
+		if (saplingblocks(device, p, &b) == 0)
+			*blkcnt += b;
+		else
+			return -1;
 	}
 	return 0;
 }
 
+/*
+ * Compare - idxlist[] in ascending order of block number
+ */
+int cmp_idxblk_blk(const void *a, const void *b) {
+	struct idxblk *aa = (struct idxblk*)a;
+	struct idxblk *bb = (struct idxblk*)b;
+	if (aa->blocknum == bb->blocknum)
+		return 0;
+	return (aa->blocknum < bb->blocknum) ? -1 : 1;
+}
+
+/*
+ * Compare - idxlist[] in order of directory entry
+ */
+int cmp_idxblk_ent(const void *a, const void *b) {
+	struct idxblk *aa = (struct idxblk*)a;
+	struct idxblk *bb = (struct idxblk*)b;
+	if (aa->blockidx != bb->blockidx)
+		return aa->blockidx - bb->blockidx;
+	return aa->entrynum - bb->entrynum;
+}
+
+/*
+ * Read all the sub-index blocks queued by treeblocks() in ascending order
+ * of block number, then check the blocks used for each tree file.
+ * The directory blocks holding the entries must already be in blocks list.
+ */
+void flushidxblks(uchar device) {
+	static char namebuf[NMLEN+1];
+	struct pd_dirent *ent = (struct pd_dirent*)buf2;
+	struct block *b;
+	uint i, j, count, blks;
+	uchar bad;
+	char *entp;
+	if (numidx == 0)
+		return;
+	qsort(idxlist, numidx, sizeof(struct idxblk), cmp_idxblk_blk);
+	for (i = 0; i < numidx; ++i) {
+#ifdef OWNERMAP
+		ownblk = blockidxtoblocknum(idxlist[i].blockidx);
+		ownent = idxlist[i].entrynum;
+#endif
+		/* A count of 0 marks a sub-index block which could not be read */
+		if (saplingblocks(device, idxlist[i].blocknum,
+		                  &(idxlist[i].count)) == -1)
+			idxlist[i].count = 0;
+	}
+	qsort(idxlist, numidx, sizeof(struct idxblk), cmp_idxblk_ent);
+	for (i = 0; i < numidx; i = j) {
+		count = 1; /* Master index block */
+		bad = 0;
+		for (j = i; j < numidx; ++j) {
+			if ((idxlist[j].blockidx != idxlist[i].blockidx) ||
+			    (idxlist[j].entrynum != idxlist[i].entrynum))
+				break;
+			if (idxlist[j].count == 0)
+				bad = 1;
+			count += idxlist[j].count;
+		}
+		if (bad)
+			continue;
+		b = blocks;
+		for (blks = 1; blks < idxlist[i].blockidx; ++blks)
+			b = b->next;
+		entp = b->data + PTRSZ + (idxlist[i].entrynum - 1) * entsz;
+#ifdef AUXMEM
+		copyaux(entp, buf2, entsz, FROMAUX);
+#else
+		memcpy(buf2, entp, entsz);
+#endif
+		blks = ent->blksused[0] + 256U * ent->blksused[1];
+		if (blks != count) {
+			fixcase(ent->name, namebuf,
+			        ent->vers, ent->minvers, ent->typ_len & 0x0f);
+			err(NONFATAL, err_used3, namebuf, blks, count);
+			if (askfix() == 1) {
+				ent->blksused[0] = count & 0xff;
+				ent->blksused[1] = (count >> 8) & 0xff;
+#ifdef AUXMEM
+				copyaux(buf2, entp, entsz, TOAUX);
+#else
+				memcpy(entp, buf2, entsz);
+#endif
+			}
+		}
+	}
+	numidx = 0;
+}
+
 /*
  * Count the blocks in a GSOS fork file
  * See http://1000bit.it/support/manual/apple/technotes/pdos/tn.pdos.25.html
@@ -1086,7 +1923,7 @@ int forkblocks(uchar device, uint keyblk, uint *blkcnt) {
 		break;
 	case 0x3:
 		/* Tree */
-		treeblocks(device, d_keyblk, &count);
+		treeblocks(device, d_keyblk, 0, 0, &count);
 		break;
 	default:
 		err(NONFATAL, err_stype2, d_type, "data fork");
@@ -1117,7 +1954,7 @@ int forkblocks(uchar device, uint keyblk, uint *blkcnt) {
 		break;
 	case 0x3:
 		/* Tree */
-		treeblocks(device, r_keyblk, &count);
+		treeblocks(device, r_keyblk, 0, 0, &count);
 		break;
 	default:
 		err(NONFATAL, err_stype2, r_type, "res fork");
@@ -1206,9 +2043,237 @@ int  subdirblocks(uchar device, uint keyblk, struct pd_dirent *ent,
 
 #endif
 
+#ifdef MOVEFILE
+
 /*
- * Record the keyblock of a subdirectory to be processed subsequently
- * blocknum is the block number of the subdirectory keyblock
+ * The mv*() routines walk the blocks of a file in layout order, that is
+ * each index block followed by the blocks it points to.  If mvcopy is 0,
+ * they survey the file, counting the blocks in mvcount and clearing
+ * mvcontig if the blocks do not follow on from one another.  If mvcopy is
+ * 1, they copy each block to the next block of the run starting at mvnext,
+ * rewriting the index blocks to match.  If mvcopy is 2, they release the
+ * blocks of the old copy of the file, once nothing points to it.  Sparse
+ * (zero) pointers are left unallocated.  Each returns the new block number
+ * of the block passed in.
+ * Buffers: dirblkbuf[] tree master / fork key, buf2[] index, buf[] data.
+ */
+
+/*
+ * Allocate the next block in layout order for an index block which will be
+ * written later by mvcommit().
+ */
+uint mvreserve(uint blk) {
+	if (!mvcopy) {
+		if (blk != mvnext)
+			mvcontig = 0;
+		mvnext = blk + 1;
+		++mvcount;
+		return blk;
+	}
+	if (mvcopy == 2)
+		return blk;
+	return mvnext++;
+}
+
+/*
+ * Write a block to its new location, or release the old one
+ * The old block is left in use until the release pass.
+ */
+void mvcommit(uchar device, uint blk, uint newblk, char *data) {
+	if (!mvcopy)
+		return;
+	if (mvcopy == 2) {
+		trimdirblock(blk);
+		return;
+	}
+	if (writediskblock(device, newblk, data) == -1)
+		err(FATAL, err_wtblk1, newblk);
+	allocblock(newblk);
+}
+
+/*
+ * Move a data block
+ */
+uint mvblock(uchar device, uint blk) {
+	uint newblk = mvreserve(blk);
+	if (!mvcopy)
+		return blk;
+	if ((mvcopy == 1) && (readdiskblock(device, blk, buf) == -1))
+		err(FATAL, err_rdblk1, blk);
+	mvcommit(device, blk, newblk, buf);
+	return newblk;
+}
+
+/*
+ * Move a sapling index block and the data blocks it points to
+ */
+uint mvsapling(uchar device, uint keyblk, char *idxbuf) {
+	uint i, p, newblk = mvreserve(keyblk);
+	if (readdiskblock(device, keyblk, idxbuf) == -1)
+		err(FATAL, err_rdblk1, keyblk);
+	for (i = 0; i < 256; ++i) {
+		p = idxbuf[i] + 256U * idxbuf[i+256];
+		if (p) {
+			p = mvblock(device, p);
+			idxbuf[i] = p & 0xff;
+			idxbuf[i+256] = (p >> 8) & 0xff;
+		}
+	}
+	mvcommit(device, keyblk, newblk, idxbuf);
+	return newblk;
+}
+
+/*
+ * Move a tree master index block and the sub-index blocks it points to
+ */
+uint mvtree(uchar device, uint keyblk) {
+	uint i, p, newblk = mvreserve(keyblk);
+	if (readdiskblock(device, keyblk, dirblkbuf) == -1)
+		err(FATAL, err_rdblk1, keyblk);
+	for (i = 0; i < 256; ++i) {
+		p = dirblkbuf[i] + 256U * dirblkbuf[i+256];
+		if (p) {
+			p = mvsapling(device, p, buf2);
+			dirblkbuf[i] = p & 0xff;
+			dirblkbuf[i+256] = (p >> 8) & 0xff;
+		}
+	}
+	mvcommit(device, keyblk, newblk, dirblkbuf);
+	return newblk;
+}
+
+/*
+ * Move a GSOS fork key block followed by the data and resource forks
+ * The key block is re-read at the end because the forks use dirblkbuf[].
+ */
+uint mvfork(uchar device, uint keyblk) {
+	uint d_keyblk, r_keyblk, newblk = mvreserve(keyblk);
+	uchar d_type, r_type;
+	if (readdiskblock(device, keyblk, dirblkbuf) == -1)
+		err(FATAL, err_rdblk1, keyblk);
+	d_type = dirblkbuf[0x00];
+	d_keyblk = dirblkbuf[0x01] + 256U * dirblkbuf[0x02];
+	r_type = dirblkbuf[0x100];
+	r_keyblk = dirblkbuf[0x101] + 256U * dirblkbuf[0x102];
+	d_keyblk = mvfile(device, d_type, d_keyblk);
+	r_keyblk = mvfile(device, r_type, r_keyblk);
+	if (mvcopy != 1) {
+		mvcommit(device, keyblk, newblk, dirblkbuf);
+		return keyblk;
+	}
+	if (readdiskblock(device, keyblk, dirblkbuf) == -1)
+		err(FATAL, err_rdblk1, keyblk);
+	dirblkbuf[0x01] = d_keyblk & 0xff;
+	dirblkbuf[0x02] = (d_keyblk >> 8) & 0xff;
+	dirblkbuf[0x101] = r_keyblk & 0xff;
+	dirblkbuf[0x102] = (r_keyblk >> 8) & 0xff;
+	mvcommit(device, keyblk, newblk, dirblkbuf);
+	return newblk;
+}
+
+/*
+ * Move a file (or fork) of storage type type (1,2,3,5)
+ */
+uint mvfile(uchar device, uchar type, uint keyblk) {
+	switch (type) {
+	case 0x1:
+		return mvblock(device, keyblk);
+	case 0x2:
+		return mvsapling(device, keyblk, buf2);
+	case 0x3:
+		return mvtree(device, keyblk);
+	case 0x5:
+		return mvfork(device, keyblk);
+	}
+	return keyblk;
+}
+
+/*
+ * Move each fragmented file in the current directory to the lowest run of
+ * free blocks which will hold it, updating the key pointers of the entries
+ * in the blocks list.  For each file, the freelist marking the new blocks
+ * used is written, then the directory block pointing to them, and only
+ * then are the old blocks released, so the volume is never left with live
+ * blocks marked free.
+ * Uses dirblkbuf[], so must be called after readdir() and before sorting.
+ */
+void movefiles(uchar device) {
+	static char namebuf[NMLEN+1];
+	static struct pd_dirent ent;
+	struct block *b = blocks;
+	uchar entry, firstent = 2, type;
+	uint keyblk, newblk, run;
+	char *entp;
+	if (errcount > errstart) {
+		puts(err_nomvfile);
+		return;
+	}
+	while (b) {
+		for (entry = firstent; entry <= entperblk; ++entry) {
+			entp = b->data + PTRSZ + (entry - 1) * entsz;
+#ifdef AUXMEM
+			copyaux(entp, (char*)&ent, ENTSZ, FROMAUX);
+#else
+			memcpy(&ent, entp, ENTSZ);
+#endif
+			type = ent.typ_len >> 4;
+			/* Seedlings can't be fragmented */
+			if ((type != 0x2) && (type != 0x3) && (type != 0x5))
+				continue;
+			keyblk = ent.keyptr[0] + 256U * ent.keyptr[1];
+			mvcopy = 0;
+			mvcontig = 1;
+			mvnext = keyblk;
+			mvcount = 0;
+			mvfile(device, type, keyblk);
+			if (mvcontig)
+				continue;
+			run = findfreerun(mvcount);
+			if (!run)
+				continue;
+			fixcase(ent.name, namebuf,
+			        ent.vers, ent.minvers, ent.typ_len & 0x0f);
+			printf("Moving %s to blks %u-%u\n",
+			       namebuf, run, run + mvcount - 1);
+			mvcopy = 1;
+			mvnext = run;
+			newblk = mvfile(device, type, keyblk);
+			if (writefreelist(device))
+				return;
+			ent.keyptr[0] = newblk & 0xff;
+			ent.keyptr[1] = (newblk >> 8) & 0xff;
+#ifdef AUXMEM
+			copyaux((char*)&ent, entp, ENTSZ, TOAUX);
+			copyaux(b->data, dirblkbuf, BLKSZ, FROMAUX);
+#else
+			memcpy(entp, &ent, ENTSZ);
+			memcpy(dirblkbuf, b->data, BLKSZ);
+#endif
+			if (writediskblock(device, b->blocknum, dirblkbuf) == -1) {
+				err(NONFATAL, err_wtblk1, b->blocknum);
+				/* Entry on disk still points to the old copy */
+				ent.keyptr[0] = keyblk & 0xff;
+				ent.keyptr[1] = (keyblk >> 8) & 0xff;
+#ifdef AUXMEM
+				copyaux((char*)&ent, entp, ENTSZ, TOAUX);
+#else
+				memcpy(entp, &ent, ENTSZ);
+#endif
+				return;
+			}
+			mvcopy = 2;
+			mvfile(device, type, keyblk);
+		}
+		b = b->next;
+		firstent = 1;
+	}
+}
+
+#endif
+
+/*
+ * Record the keyblock of a subdirectory to be processed subsequently
+ * blocknum is the block number of the subdirectory keyblock
  * subdiridx is a sequential counter of the subdirs in the current directory
  */
 void enqueuesubdir(uint blocknum, uint subdiridx) {
@@ -1248,6 +2313,9 @@ int readdir(uint device, uint blocknum) {
 	uint hdrblknum = blocknum;
 
 	numfiles = 0;
+#ifdef CHECK
+	numidx = 0;
+#endif
 
 	blocks = (struct block*)malloc(sizeof(struct block));
 	if (!blocks)
@@ -1260,6 +2328,20 @@ int readdir(uint device, uint blocknum) {
 	curblk->data = auxalloc(BLKSZ);
 #endif
 
+#ifdef SURFACE
+	ownername = "";
+#endif
+#ifdef OWNERMAP
+	ownblk = blocknum;
+	ownent = 1; /* Directory header */
+#endif
+#ifdef LAYOUT
+	if (dolayout) {
+		bzero(&dirlayout, sizeof(struct layout));
+		bzero(&filelayout, sizeof(struct layout));
+		curlayout = &dirlayout;
+	}
+#endif
 #ifdef FREELIST
 	checkblock(blocknum, "Directory");
 #endif
@@ -1276,6 +2358,9 @@ int readdir(uint device, uint blocknum) {
 
 	fixcase(hdr->name, currdir,
 	        hdr->vers, hdr->minvers, hdr->typ_len & 0x0f);
+#ifdef SURFACE
+	ownername = currdir;
+#endif
 
 	hlinechar('=');
 	printf("Directory %s (%u", currdir, filecount);
@@ -1359,6 +2444,13 @@ int readdir(uint device, uint blocknum) {
 
 			fixcase(ent->name, namebuf,
 			        ent->vers, ent->minvers, ent->typ_len & 0x0f);
+#ifdef SURFACE
+			ownername = namebuf;
+#endif
+#ifdef OWNERMAP
+			ownblk = blocknum;
+			ownent = blkentries;
+#endif
 
 			switch (ent->typ_len & 0xf0) {
 			case 0x10:
@@ -1422,6 +2514,10 @@ int readdir(uint device, uint blocknum) {
 					ent->hdrptr[1] = (hdrblknum >> 8)&0xff;
 				}
 			}
+#endif
+#ifdef LAYOUT
+			if (dolayout)
+				curlayout = &filelayout;
 #endif
 			switch (ent->typ_len & 0xf0) {
 			case 0xd0:
@@ -1442,8 +2538,10 @@ int readdir(uint device, uint blocknum) {
 				saplingblocks(device, keyblk, &count);
 				break;
 			case 0x30:
-				/* Tree */
-				treeblocks(device, keyblk, &count);
+				/* Tree, not batched past blkidx 255 (a uchar) */
+				treeblocks(device, keyblk,
+				           (blkcnt > 255) ? 0 : blkcnt, blkentries,
+				           &count);
 				break;
 			case 0x40:
 				/* Pascal area */
@@ -1480,6 +2578,12 @@ int readdir(uint device, uint blocknum) {
 #endif
 			} else
 				putchar('\n');
+#ifdef LAYOUT
+			if (dolayout) {
+				layoutdone(&filelayout, namebuf, hdrblknum);
+				curlayout = &dirlayout;
+			}
+#endif
 			++entries;
 		}
 		if (blkentries == entperblk) {
@@ -1492,6 +2596,11 @@ int readdir(uint device, uint blocknum) {
 			if (blocknum == 0) {
 				break;
 			}
+#ifdef CHECK
+			/* Don't let the queue fill up before the next block */
+			if (numidx > maxidx / 2)
+				flushidxblks(device);
+#endif
 			curblk->next = (struct block*)malloc(sizeof(struct block));
 			if (!curblk->next)
 				err(FATALALLOC, err_nomem);
@@ -1504,6 +2613,13 @@ int readdir(uint device, uint blocknum) {
 			curblk->data = auxalloc(BLKSZ);
 #endif
 
+#ifdef SURFACE
+			ownername = currdir;
+#endif
+#ifdef OWNERMAP
+			ownblk = hdrblknum;
+			ownent = 1;
+#endif
 #ifdef FREELIST
 			checkblock(blocknum, "Directory");
 #endif
@@ -1531,6 +2647,15 @@ int readdir(uint device, uint blocknum) {
 #else
 	memcpy(curblk->data, dirblkbuf, BLKSZ);
 #endif
+#ifdef CHECK
+	flushidxblks(device);
+#endif
+#ifdef LAYOUT
+	if (dolayout) {
+		layoutdone(&dirlayout, currdir, hdrblknum);
+		curlayout = NULL;
+	}
+#endif
 
 done:
 	return errcount - errsbefore;
@@ -1858,10 +2983,15 @@ void sortlist(char s) {
 /*
  * Convert block index to block number
  * Block index is 1-based (1,2,3 ...)
+ * If the directory is being moved, returns the new block number.
  */
 uint blockidxtoblocknum(uint idx) {
 	uint i;
 	struct block *p = blocks;
+#ifdef MOVEDIR
+	if (relocblk)
+		return relocblk + idx - 1;
+#endif
 	for (i = 1; i < idx; ++i)
 		p = p->next;
 	return p->blocknum;
@@ -1913,12 +3043,23 @@ void copydirent(uint srcblk, uint srcent, uint dstblk, uint dstent, uint device)
 	memcpy(dstptr, srcptr, entsz);
 #endif
 
-	/* For directories, update the parent dir entry number */
 	ent = (struct pd_dirent*)dstptr;
+
+#ifdef MOVEDIR
+	/* If moving the directory, point entries to the new key block */
+	if (relocblk && ((dstblk != 1) || (dstent != 1))) {
+		ent->hdrptr[0] = relocblk & 0xff;
+		ent->hdrptr[1] = (relocblk >> 8) & 0xff;
+	}
+#endif
+
+	/* For directories, update the parent dir entry number */
 	if ((ent->typ_len & 0xf0) == 0xd0) {
 		uint block = ent->keyptr[0] + 256U * ent->keyptr[1];
-		if (readdiskblock(device, block, buf) == -1)
+		if (readdiskblock(device, block, buf) == -1) {
 			err(NONFATAL, err_updsdir1, "read");
+			return;
+		}
 		hdr = (struct pd_dirhdr*)(buf + PTRSZ);
 		parentblk = blockidxtoblocknum(dstblk);
 		hdr->parptr[0] = parentblk & 0xff;
@@ -1934,9 +3075,11 @@ void copydirent(uint srcblk, uint srcent, uint dstblk, uint dstent, uint device)
 /*
  * Build sorted directory block dstblk (1,2,3...) using the sorted list in
  * filelist[]. Note that the block and entry numbers are 1-based indices.
+ * lastblk is the index of the block which is to become the last block of
+ * the directory, or 0 if the directory is not to be trimmed.
  * Returns 1 if last block of directory, 0 otherwise.
  */
-uchar sortblock(uint device, uint dstblk) {
+uchar sortblock(uint device, uint dstblk, uint lastblk) {
 	uint i, firstlistent, lastlistent;
 	uchar destentry, rc = 0;
 	copydirblkptrs(dstblk);
@@ -1951,83 +3094,226 @@ uchar sortblock(uint device, uint dstblk) {
 		lastlistent = firstlistent + entperblk - 1;
 	}
 
-	if (lastlistent > numfiles - 1) {
-
-		lastlistent = numfiles - 1;
-
-#ifdef TRIMDIR
-// TODO: Fix EOF for directory
-#ifdef AUXMEM
+	if (dstblk == lastblk) {
 		dirblkbuf[2] = dirblkbuf[3] = 0; /* Set next ptr to NULL */
-#else
-		p->data[2] = p->data[3] = 0; /* Set next ptr to NULL */
-#endif
 		rc = 1;
-#else
-		rc = 0;
-#endif
 	}
 
-	for (i = firstlistent; i <= lastlistent; ++i) {
+	for (i = firstlistent; (i <= lastlistent) && (i < numfiles); ++i) {
 		copydirent(filelist[i].blockidx, filelist[i].entrynum,
 		           dstblk, destentry++, device);
 	}
 	return rc;
 }
 
+#ifdef TRIMDIR
+
+/*
+ * Update the blocks used and EOF in the parent directory entry of a
+ * subdirectory which has been trimmed to blks blocks.  If the subdirectory
+ * has been moved, the key pointer is also updated.
+ * The header of the subdirectory is in the first block of blocks list.
+ * Returns 0 if the parent entry was written (or there is no parent), 1 if
+ * not.
+ */
+uchar updateparent(uchar device, uint blks) {
+	struct pd_dirhdr *hdr = (struct pd_dirhdr*)(buf2 + PTRSZ);
+	struct pd_dirent *ent;
+	uint parblk, keyblk;
+	ulong eof = (ulong)blks * BLKSZ;
+#ifdef AUXMEM
+	copyaux(blocks->data, buf2, PTRSZ + ENTSZ, FROMAUX);
+#else
+	memcpy(buf2, blocks->data, PTRSZ + ENTSZ);
+#endif
+	if ((hdr->typ_len & 0xf0) != 0xe0)
+		return 0; /* Volume directory has no parent */
+	parblk = hdr->parptr[0] + 256U * hdr->parptr[1];
+	if (readdiskblock(device, parblk, buf) == -1) {
+		err(NONFATAL, err_updpar1, "read");
+		return 1;
+	}
+	ent = (struct pd_dirent*)(buf + PTRSZ +
+	                          (hdr->parentry - 1) * hdr->parentlen);
+	keyblk = ent->keyptr[0] + 256U * ent->keyptr[1];
+	if (keyblk != blocks->blocknum) {
+		err(NONFATAL, err_updpar1, "key blk");
+		return 1;
+	}
+#ifdef MOVEDIR
+	if (relocblk) {
+		ent->keyptr[0] = relocblk & 0xff;
+		ent->keyptr[1] = (relocblk >> 8) & 0xff;
+	}
+#endif
+	ent->blksused[0] = blks & 0xff;
+	ent->blksused[1] = (blks >> 8) & 0xff;
+	ent->eof[0] = eof & 0xff;
+	ent->eof[1] = (eof >> 8) & 0xff;
+	ent->eof[2] = (eof >> 16) & 0xff;
+	if (writediskblock(device, parblk, buf) == -1) {
+		err(NONFATAL, err_updpar1, "write");
+		return 1;
+	}
+	return 0;
+}
+
+#endif
+
 /*
  * Build each sorted directory block in turn, then write them
- * out to disk.
+ * out to disk.  If TRIMDIR is enabled, any blocks following the last
+ * block needed to hold the entries are released to the freelist.
+ * If MOVEDIR is enabled and requested, a subdirectory is written to the
+ * lowest run of free blocks which is long enough to hold it, unless it
+ * is already in a contiguous run at least as low.
  */
 uchar writedir(uchar device) {
-	uint dstblk = 1;
-	uchar finished = 0;
+	uint dstblk = 1, lastblk = 0, blk;
+	uchar finished = 0, rc = 0;
 	struct block *b = blocks;
+#ifdef TRIMDIR
+	uint trimmed = 0;
+#endif
+#ifdef MOVEDIR
+	uint i;
+	uchar contig;
+#endif
+#ifdef TRIMDIR
+
+	/* Blocks needed for the header plus the active entries */
+	lastblk = (numfiles + entperblk) / entperblk;
+
+	/* Standard volume directory is blocks 2-5 (4 blocks)
+	 * We will not trim volume directory to less than 4 blocks
+	 */
+	if ((blocks->blocknum == 2) && (lastblk < 4))
+		lastblk = 4;
+#endif
+#ifdef MOVEDIR
+	relocblk = 0;
+#ifdef REPORT
+	if (domovedirs && (blocks->blocknum != 2) && !isprotected() && !rptonvol) {
+#else
+	if (domovedirs && (blocks->blocknum != 2) && !isprotected()) {
+#endif
+		if (errcount == errstart) {
+			/* Count the blocks and see if they are already contiguous */
+			i = 0;
+			contig = 1;
+			for (b = blocks; b; b = b->next) {
+				if ((i < lastblk) && (b->blocknum != blocks->blocknum + i))
+					contig = 0;
+				++i;
+			}
+			if (i >= lastblk) {
+				relocblk = findfreerun(lastblk);
+				/* Keep it where it is if contiguous and lower already */
+				if (contig && (relocblk > blocks->blocknum))
+					relocblk = 0;
+			}
+			if (relocblk) {
+				printf("Moving dir to blks %u-%u\n",
+				       relocblk, relocblk + lastblk - 1);
+				/* New blks must be marked used on disk before
+				 * anything points to them */
+				for (i = 0; i < lastblk; ++i)
+					allocblock(relocblk + i);
+				if (writefreelist(device)) {
+					relocblk = 0;
+					return 1;
+				}
+			}
+		} else
+			puts(err_nomove);
+	}
+	b = blocks;
+#endif
 	while (b) {
 		if (!finished) {
-			finished = sortblock(device, dstblk++);
-			if (writediskblock(device, b->blocknum, dirblkbuf) == -1) {
-				err(NONFATAL, err_wtblk1, b->blocknum);
+			finished = sortblock(device, dstblk, lastblk);
+			blk = b->blocknum;
+#ifdef MOVEDIR
+			if (relocblk) {
+				/* Link the blocks of the new contiguous chain */
+				blk = relocblk + dstblk - 1;
+				dirblkbuf[0] = dirblkbuf[1] = dirblkbuf[2] = dirblkbuf[3] = 0;
+				if (dstblk > 1) {
+					dirblkbuf[0] = (blk - 1) & 0xff;
+					dirblkbuf[1] = ((blk - 1) >> 8) & 0xff;
+				}
+				if (!finished) {
+					dirblkbuf[2] = (blk + 1) & 0xff;
+					dirblkbuf[3] = ((blk + 1) >> 8) & 0xff;
+				}
+			}
+#endif
+			++dstblk;
+			if (writediskblock(device, blk, dirblkbuf) == -1) {
+				err(NONFATAL, err_wtblk1, blk);
+#ifdef MOVEDIR
+				relocblk = 0;
+#endif
 				return 1;
 			}
-#ifdef FREELIST
+#ifdef TRIMDIR
 		} else {
-			/* Standard volume directory is blocks 2-5 (4 blocks)
-			 * We will not trim volume directory to less than 4 blocks
-			 */
-			if (b->blocknum > 5) {
-				puts("Trimming dir blk");
+			puts("Trimming dir blk");
+#ifdef MOVEDIR
+			if (!relocblk) /* Old blks are released below */
+#endif
 				trimdirblock(b->blocknum);
-			}
+			++trimmed;
+#endif
 		}
+		b = b->next;
+	}
+#ifdef TRIMDIR
+#ifdef MOVEDIR
+	if (trimmed || relocblk)
 #else
-		}
+	if (trimmed)
+#endif
+		rc = updateparent(device, lastblk);
+#endif
+#ifdef MOVEDIR
+	/* Release the old blks only once the parent points to the new ones.
+	 * If that failed, both copies are left marked as used. */
+	if (relocblk && (rc == 0)) {
+		for (b = blocks; b; b = b->next)
+			trimdirblock(b->blocknum);
+#ifdef MANIFEST
+		mfmoved(relocblk);
 #endif
-		b = b->next;
 	}
-	return 0;
+	relocblk = 0;
+#endif
+	return rc;
 }
 
 #ifdef FREELIST
 
 /*
  * Write the freelist back to disk.
+ * Only the blocks of the freelist flagged in flchanged are written.
  */
 uchar writefreelist(uchar device) {
 	uchar b;
-	puts("Writing freelist ...");
 	for (b = 0; b < flsize; ++b) {
+		if (!(flchanged & (1U << b)))
+			continue;
 #ifdef AUXMEM
 		copyaux(freelist + b * BLKSZ, dirblkbuf, BLKSZ, FROMAUX);
 #else
 		memcpy(dirblkbuf, freelist + b * BLKSZ, BLKSZ);
 #endif
-		if (writediskblock(device, flblk, dirblkbuf) == -1) {
-			err(NONFATAL, err_wtblk1, flblk);
+		if (writediskblock(device, flblk + b, dirblkbuf) == -1) {
+			err(NONFATAL, err_wtblk1, flblk + b);
 			return 1;
 		}
-		++flblk;
+		++flwritten;
 	}
+	flchanged = 0;
 	return 0;
 }
 
@@ -2046,6 +3332,10 @@ void freeblocks(void) {
 	blocks = NULL;
 }
 
+#ifdef OVERLAYS
+#pragma code-name (push, "OVERLAY1")
+#pragma rodata-name (push, "OVERLAY1")
+#endif
 void subtitle(char *s) {
 	uchar i;
 	putchar('\n');
@@ -2060,23 +3350,65 @@ void subtitle(char *s) {
 
 void interactive(void) {
 	char w, l, d, f, wrt;
+#ifdef CHECK
+	char b;
+#endif
+#if defined(MOVEDIR) || defined(MOVEFILE)
+	char m;
+#endif
+#ifdef LAYOUT
+	char a;
+#endif
 #ifdef FREELIST
 	char z;
 #endif
-	uchar level;
+#ifdef MANIFEST
+	char k;
+#endif
+	uchar level, back = 0;
 
 	doverbose = 1;
 
 	revers(1);
 	hlinechar(' ');
-	fputs("S O R T D I R  v0.92 alpha                  Use ^ to return to previous question", stdout);
+	fputs("S O R T D I R  v1.06 alpha                  Use ^ to return to previous question", stdout);
 	hlinechar(' ');
 	revers(0);
 
+#ifdef REPORT
+	putchar('\n');
+	revers(1);
+	fputs("Report file (- for none)>", stdout);
+	revers(0);
+	putchar(' ');
+	scanf("%64s", rptpath);
+	getchar(); // Eat the carriage return
+	if (strcmp(rptpath, "-") == 0)
+		rptpath[0] = '\0';
+#endif
+
+#ifdef CHECKPOINT
+	putchar('\n');
+	revers(1);
+	fputs("Checkpoint file on another volume (- for none)>", stdout);
+	revers(0);
+	putchar(' ');
+	scanf("%64s", ckptpath);
+	getchar(); // Eat the carriage return
+	if (strcmp(ckptpath, "-") == 0)
+		ckptpath[0] = '\0';
+	else if ((doresume = askresume()) == 1)
+		return;
+#endif
+
 q1:
 	putchar('\n');
 	revers(1);
+#ifdef JOBS
+	fputs("Enter start path (* for all volumes, @file for job file)>", stdout);
+#else
 	fputs("Enter start path>", stdout);
+#endif
 	revers(0);
 	putchar(' ');
 	scanf("%s", buf);
@@ -2157,20 +3489,155 @@ q6:
 	} while (strchr("-yn^", f) == NULL);
 	if (f == '^')
 		goto q5;
+	back = 0;
 	fixopts[0] = f;
 
+	/*
+	 * The questions from here on are not all asked.  If ^ is used to go
+	 * back, back is set so that those not asked are passed over, and
+	 * each goes back to the question before it.
+	 */
+q7:
+#ifdef CHECK
+	if (w != '-') {
+		subtitle("Tree file index block reads");
+		do {
+			fputs("| [-] Per file   | [b] Batched per dir     |                                   |", stderr);
+			b = getchar();
+		} while (strchr("-b^", b) == NULL);
+		if (b == '^') {
+			back = 1;
+			goto q6;
+		}
+		back = 0;
+		dobatch = (b == 'b');
+	} else
+#endif
+	if (back)
+		goto q6;
+
+q8:
+#ifdef LAYOUT
+	subtitle("Fragmentation and layout analysis?");
+	do {
+		fputs("| [-] No         | [l] Analyse layout      |                                   |", stderr);
+		a = getchar();
+	} while (strchr("-l^", a) == NULL);
+	if (a == '^') {
+		back = 1;
+		goto q7;
+	}
+	back = 0;
+	dolayout = (a == 'l');
+#else
+	if (back)
+		goto q7;
+#endif
+
+q9:
+#ifdef MOVEDIR
+	if (w != '-') {
+		subtitle("Move directories to contiguous blocks near volume dir?");
+		do {
+			fputs("| [-] No         | [m] Move directories    |                                   |", stderr);
+			m = getchar();
+		} while (strchr("-m^", m) == NULL);
+		if (m == '^') {
+			back = 1;
+			goto q8;
+		}
+		back = 0;
+		domovedirs = (m == 'm');
+	} else
+#endif
+	if (back)
+		goto q8;
+
+q10:
+#ifdef MOVEFILE
+	subtitle("Move fragmented files to contiguous blocks?");
+	do {
+		fputs("| [-] No         | [m] Move files          |                                   |", stderr);
+		m = getchar();
+	} while (strchr("-m^", m) == NULL);
+	if (m == '^') {
+		back = 1;
+		goto q9;
+	}
+	back = 0;
+	domovefiles = (m == 'm');
+#else
+	if (back)
+		goto q9;
+#endif
+
+q11:
+#ifdef SURFACE
+	if (w == 'v') {
+		subtitle("Surface scan for unreadable blocks?");
+		do {
+			fputs("| [-] No         | [s] Scan every block    |                                   |", stderr);
+			z = getchar();
+		} while (strchr("-s^", z) == NULL);
+		if (z == '^') {
+			back = 1;
+			goto q10;
+		}
+		back = 0;
+		dosurface = (z == 's');
+	} else
+#endif
+	if (back)
+		goto q10;
+
+q12:
 #ifdef FREELIST
 	if (w == 'v') {
 		subtitle("Zero free space?");
 		do {
-			fputs("| [-] No         | [z] Zero free blocks    |                                   |", stderr);
+			fputs("| [-] No         | [z] Zero free blocks    | [r] Read first, zero if non-zero  |", stderr);
 			z = getchar();
-		} while (strchr("-z^", z) == NULL);
-		if (z == '^')
-			goto q6;
+		} while (strchr("-zr^", z) == NULL);
+		if (z == '^') {
+			back = 1;
+			goto q11;
+		}
+		back = 0;
+		dozero = 0;
 		if (z == 'z')
 			dozero = 1;
+		if (z == 'r')
+			dozero = 2;
+	} else
+#endif
+	if (back)
+		goto q11;
+
+q13:
+#ifdef MANIFEST
+	subtitle("CRC-32 manifest of file contents?");
+	do {
+		fputs("| [-] No         | [u] Hash changed files  | [v] Hash and verify all files     |", stderr);
+		k = getchar();
+	} while (strchr("-uv^", k) == NULL);
+	if (k == '^') {
+		back = 1;
+		goto q12;
+	}
+	back = 0;
+	dohash = (k == 'u') ? 1 : (k == 'v') ? 2 : 0;
+	if (dohash) {
+		putchar('\n');
+		revers(1);
+		fputs("Manifest directory on another volume>", stdout);
+		revers(0);
+		putchar(' ');
+		scanf("%64s", mfdir);
+		getchar(); // Eat the carriage return
 	}
+#else
+	if (back)
+		goto q12;
 #endif
 
 	subtitle("Confirm write to disk");
@@ -2178,11 +3645,17 @@ q6:
 		fputs("| [-] No         | [w] Write to disk       |                                   |", stderr);
 		wrt = getchar();
 	} while (strchr("-w^", wrt) == NULL);
-	if (wrt == '^')
-		goto q6;
+	if (wrt == '^') {
+		back = 1;
+		goto q13;
+	}
 	if (wrt == 'w')
 		dowrite = 1;
 }
+#ifdef OVERLAYS
+#pragma code-name (pop)
+#pragma rodata-name (pop)
+#endif
 
 
 /*
@@ -2191,12 +3664,39 @@ q6:
  */
 void processdir(uint device, uint blocknum) {
 	uchar i, errs;
+#ifdef REPORT
+	uint errs0 = errcount, fixes0 = fixcount, wrts0 = wrtcount;
+	if (rptfd != -1)
+		dirpath(device, blocknum, rptdirpath);
+#endif
 	flushall();
 	if (readdir(device, blocknum) != 0) {
 		err(NONFATAL, err_nosort);
 		putchar('\n');
 		goto done;
 	}
+#ifdef MANIFEST
+	if (dohash)
+		hashdir(device, blocknum);
+#endif
+#ifdef REPORT
+	/* ProDOS updates the report file's entry when it writes to it.
+	 * If the path could not be found, play safe. */
+	if (rptonvol && ((rptdirpath[0] == '\0') ||
+	    ((strlen(rptdirpath) == rptdirlen) &&
+	     (strncasecmp(rptdirpath, rptabs, rptdirlen) == 0)))) {
+		puts(err_rptdir);
+		goto done;
+	}
+#endif
+#ifdef MOVEFILE
+#ifdef REPORT
+	if (domovefiles && dowrite && !isprotected() && !rptonvol)
+#else
+	if (domovefiles && dowrite && !isprotected())
+#endif
+		movefiles(device);
+#endif
 #ifdef SORT
 	if (strlen(sortopts) > 0) {
 		if (doverbose)
@@ -2225,6 +3725,9 @@ void processdir(uint device, uint blocknum) {
 	}
 #endif
 done:
+#ifdef REPORT
+	rptdir(errcount - errs0, fixcount - fixes0, wrtcount - wrts0);
+#endif
 	freeblocks();
 #ifdef AUXMEM
 	freeallaux();
@@ -2233,6 +3736,10 @@ done:
 
 #ifdef FREELIST
 
+#ifdef OVERLAYS
+#pragma code-name (push, "OVERLAY2")
+#pragma rodata-name (push, "OVERLAY2")
+#endif
 /*
  * Iterate through freelist[] and usedlist[] and see if all is well.
  * If we have visited all files and directories on the volume, every
@@ -2266,7 +3773,7 @@ void checkfreeandused(uchar device) {
 #else
 						freelist[byte] = fl;
 #endif
-						flchanged = 1;
+						flchanged |= (1U << (byte / BLKSZ));
 					}
 				}
 			} else {
@@ -2283,7 +3790,7 @@ void checkfreeandused(uchar device) {
 #else
 						freelist[byte] = fl;
 #endif
-						flchanged = 1;
+						flchanged |= (1U << (byte / BLKSZ));
 					}
 				}
 			}
@@ -2292,17 +3799,37 @@ void checkfreeandused(uchar device) {
 	}
 	printf("\nFree blks  %u\n", totblks - blkcnt);
 
+#ifdef REPORT
+	if (dozero && !rptonvol)
+#else
 	if (dozero)
+#endif
 		zerofreeblocks(device, totblks - blkcnt);
 }
 
 /*
- * Zero block blocknum
+ * Zero block blocknum, writing the contents of buf2, which the caller must
+ * already have zeroed.  If dozero is 2, the block is read first and is only
+ * written if it is not already zero.
+ * Returns 1 if the block was written, 0 otherwise.
  */
-void zeroblock(uchar device, uint blocknum) {
-	bzero(buf, BLKSZ);
-	if (writediskblock(device, blocknum, buf) == -1)
-		err(FATAL, err_wtblk1, blocknum);
+uchar zeroblock(uchar device, uint blocknum) {
+	uint i;
+	uchar rc;
+	if (dozero == 2) {
+		/* Not readdiskblock() - it would complain the block is free */
+		rc = dio_read(dio_hdl, blocknum, buf);
+		if (rc)
+			err(FATAL, err_rdblk2, blocknum, rc);
+		for (i = 0; i < BLKSZ; ++i)
+			if (buf[i])
+				break;
+		if (i == BLKSZ)
+			return 0;
+	}
+	if (writediskblock(device, blocknum, buf2) == -1)
+		err(FATAL, err_wtblk1, blocknum);
+	return 1;
 //	DIORecGS dr;
 //	dr.pCount = 6;
 //	dr.devNum = device;
@@ -2317,29 +3844,1156 @@ void zeroblock(uchar device, uint blocknum) {
 
 /*
  * Zero all free blocks on the volume
+ * The freelist is scanned one block (4096 disk blocks) at a time using
+ * dirblkbuf[], skipping over bytes with no free blocks.
  */
 void zerofreeblocks(uchar device, uint freeblks) {
-	uint i, step = freeblks / 60, ctr = 0;
+	uint i, blk = 0, step = freeblks / 60, ctr = 0, written = 0;
+	uchar b, fl, bit;
 	puts("Zeroing free blocks ...");
-	for (i = 0; i < totblks; ++i)
-		if (isfree(i)) {
-			zeroblock(device, i);
-			++ctr;
-			if (ctr == step) {
-				putchar('=');
-				fflush(stdout);
-				ctr = 0;
+	bzero(buf2, BLKSZ);
+	for (b = 0; b < flsize; ++b) {
+#ifdef AUXMEM
+		copyaux(freelist + b * BLKSZ, dirblkbuf, BLKSZ, FROMAUX);
+#else
+		memcpy(dirblkbuf, freelist + b * BLKSZ, BLKSZ);
+#endif
+		for (i = 0; i < BLKSZ; ++i) {
+			fl = dirblkbuf[i];
+			if (fl == 0) {
+				/* No free blocks in this byte */
+				blk += 8;
+				continue;
 			}
+			for (bit = 0; bit < 8; ++bit) {
+				if (blk >= totblks)
+					goto done;
+				if ((fl << bit) & 0x80) {
+					written += zeroblock(device, blk);
+					++ctr;
+					if (ctr == step) {
+						putchar('=');
+						fflush(stdout);
+						ctr = 0;
+					}
+				}
+				++blk;
+			}
+		}
+	}
+done:
+	printf("\nDone zeroing! Wrote %u blks, %u already zero\n",
+	       written, freeblks - written);
+}
+#ifdef OVERLAYS
+#pragma code-name (pop)
+#pragma rodata-name (pop)
+#endif
+
+#endif
+
+/*
+ * Performs all actions for a single start path
+ */
+void processtarget(char *path) {
+	uchar dev;
+	uint blk;
+#ifdef CHECKPOINT
+	uchar ckptok, resumed;
+	uint ndone = 0;
+#endif
+
+	/* Only errors found on this target stop blocks being moved */
+	errstart = errcount;
+	firstblk(path, &dev, &blk);
+
+#ifdef FREELIST
+	readfreelist(dev);
+#endif
+#ifdef REPORT
+	/* ProDOS allocates blocks for the report behind our back */
+	rptonvol = ((rptfd != -1) && onvolume(rptabs));
+	if (rptonvol && dowrite)
+		puts(err_rptvol);
+#endif
+#ifdef CHECKPOINT
+	ckptok = (ckptpath[0] != '\0');
+	if (ckptok && onvolume(ckptpath)) {
+		puts(err_ckpt4);
+		ckptok = 0;
+	}
+	resumed = (doresume && ckptok && (restorecheckpoint(dev) == 0));
+	doresume = 0;
+#ifdef MANIFEST
+	/* Groups for the dirs done before the checkpoint would be lost */
+	if (resumed && dohash) {
+		printf(err_mf4, mfdir);
+		putchar('\n');
+		dohash = 0;
+	}
+#endif
+#endif
+#ifdef SURFACE
+	/* A resumed run has the unreadable blocks from the checkpoint */
+#ifdef CHECKPOINT
+	if (dosurface && !resumed) {
+#else
+	if (dosurface) {
+#endif
+#ifdef OVERLAYS
+		loadoverlay(2);
+#endif
+		surfacescan();
+	}
+#endif
+#ifdef MANIFEST
+	if (dohash)
+		mfopen();
+#endif
+#ifdef CHECKPOINT
+	if (resumed)
+		goto pending;
+#endif
+	if (dowholedisk)
+		processdir(dev, 2);
+	else
+		processdir(dev, blk);
+#ifdef CHECKPOINT
+pending:
+#endif
+	if (dorecurse) {
+		while (dirs) {
+			struct dirblk *d = dirs;
+			blk = dirs->blocknum;
+			dirs = d->next;
+			free(d);
+			processdir(dev, blk);
+#ifdef CHECKPOINT
+			if (ckptok && dirs && ((++ndone % CKPTDIRS) == 0))
+				if (savecheckpoint(path) == -1)
+					ckptok = 0;
+#endif
+		}
+	}
+#ifdef MANIFEST
+	if (dohash)
+		mfclose();
+#endif
+#ifdef OVERLAYS
+	/* The end of volume code is loaded over the top of filelist[] */
+	loadoverlay(2);
+#endif
+#ifdef LAYOUT
+	if (dolayout)
+		printlayout();
+#endif
+#ifdef SURFACE
+	if (dosurface)
+		surfacedone();
+#endif
+#ifdef FREELIST
+	if (dowholedisk)
+		checkfreeandused(dev);
+#ifdef REPORT
+	if (dowrite && flchanged && !rptonvol)
+#else
+	if (dowrite && flchanged)
+#endif
+	{
+		puts("Writing freelist ...");
+		writefreelist(dev);
+	}
+	flloaded = 0; /* Next path may be on another volume */
+#endif
+#ifdef CHECKPOINT
+	if (ckptok)
+		remove(ckptpath); /* Finished, nothing to resume */
+#endif
+	dio_close(dio_hdl);
+}
+
+#ifdef JOBS
+
+/*
+ * Add path to the list of targets, after target after
+ * If after is NULL, path is added to the end of the list
+ * Returns the new entry
+ */
+struct target *addtarget(struct target *after, char *path) {
+	struct target *t = (struct target*)malloc(sizeof(struct target));
+	if (!t)
+		err(FATALALLOC, err_nomem);
+	strncpy(t->path, path, MAXPATH);
+	t->path[MAXPATH] = '\0';
+	t->done = 0;
+	t->errs = 0;
+	if (!after) {
+		if (!targets) {
+			t->next = NULL;
+			targets = t;
+			return t;
+		}
+		for (after = targets; after->next; after = after->next);
+	}
+	t->next = after->next;
+	after->next = t;
+	return t;
+}
+
+/*
+ * Convert ProDOS unit number to the device number used by dio_open()
+ * Unit number is DSSS00DD for ProDOS 2.5+ or DSSSxxxx for earlier versions,
+ * where xxxx is not part of the unit number.  See also firstblk().
+ */
+uchar unittodev(uchar unit) {
+	uchar slot, drive;
+	if (*(uchar*)0xbfff < 0x25) /* KVERSION */
+		unit &= 0xf0;
+	slot = (unit & 0x70) >> 4;
+	drive = ((unit & 0x80) >> 7) + ((unit & 0x03) << 1) + 1;
+	return slot + (drive - 1) * 8;
+}
+
+/*
+ * Add the volume directory of each online ProDOS volume after target t
+ */
+void addvolumes(struct target *t) {
+	uchar *devcnt = (uchar*)0xbf31; /* Number of devices - 1 */
+	uchar *devlst = (uchar*)0xbf32; /* Disk device numbers */
+	dhandle_t hdl;
+	uchar i, len, rc;
+	for (i = 0; i <= *devcnt; ++i) {
+		hdl = dio_open(unittodev(devlst[i]));
+		if (!hdl)
+			continue;
+		rc = dio_read(hdl, 2, buf);
+		dio_close(hdl);
+		if (rc || ((buf[0x04] & 0xf0) != 0xf0))
+			continue; /* Not a ProDOS volume */
+		len = buf[0x04] & 0x0f;
+		buf2[0] = '/';
+		memcpy(buf2 + 1, buf + 0x05, len);
+		buf2[len + 1] = '\0';
+		t = addtarget(t, buf2);
+	}
+}
+
+/*
+ * Read start paths from a text file, one per line, adding them after
+ * target t.  Blank lines and lines starting with # are ignored.
+ */
+void readjobfile(struct target *t) {
+	FILE *fp = fopen(t->path + 1, "r");
+	uint len;
+	if (!fp) {
+		err(NONFATAL, err_job1, t->path + 1);
+		return;
+	}
+	while (fgets(buf2, BLKSZ, fp)) {
+		len = strlen(buf2);
+		while ((len > 0) && isspace(buf2[len - 1]))
+			buf2[--len] = '\0';
+		if ((len == 0) || (buf2[0] == '#'))
+			continue;
+		t = addtarget(t, buf2);
+	}
+	fclose(fp);
+}
+
+/*
+ * Process each target in turn, then print a summary
+ */
+void processjobs(void) {
+	struct target *t;
+	uint errsbefore, n = 0;
+	for (t = targets; t; t = t->next) {
+		if (t->path[0] == '*') {
+			addvolumes(t);
+			continue;
+		}
+		if (t->path[0] == '@') {
+			readjobfile(t);
+			continue;
 		}
-	puts("\nDone zeroing!");
+		errsbefore = errcount;
+		processtarget(t->path);
+		t->errs = errcount - errsbefore;
+		t->done = 1;
+		++n;
+	}
+	if (n > 1) {
+		putchar('\n');
+		hlinechar('=');
+		puts("Summary");
+		hline();
+		for (t = targets; t; t = t->next)
+			if (t->done)
+				printf("%-64s %5u errors\n", t->path, t->errs);
+	}
 }
 
 #endif
 
+#ifdef CHECKPOINT
+
+/*
+ * Save (save=1) or restore (save=0) a bitmap p of flsize blocks to/from
+ * the checkpoint file fd.  Returns -1 on error, 0 otherwise.
+ */
+int ckptaux(int fd, uchar *p, uchar save) {
+	uint b;
+	for (b = 0; b < flsize; ++b) {
+#ifdef AUXMEM
+		if (save) {
+			copyaux((char*)p, buf, BLKSZ, FROMAUX);
+			if (write(fd, buf, BLKSZ) != BLKSZ)
+				return -1;
+		} else {
+			if (read(fd, buf, BLKSZ) != BLKSZ)
+				return -1;
+			copyaux(buf, (char*)p, BLKSZ, TOAUX);
+		}
+#else
+		if ((save ? write(fd, p, BLKSZ) : read(fd, p, BLKSZ)) != BLKSZ)
+			return -1;
+#endif
+		p += BLKSZ;
+	}
+	return 0;
+}
+
+/*
+ * Write the checkpoint file, recording the directories still to be
+ * processed, the usedlist, the error count and the options.
+ * path is the start path being processed.
+ * Returns -1 on error, 0 otherwise.
+ */
+int savecheckpoint(char *path) {
+	struct dirblk *d;
+	uint i = 0;
+	int fd;
+	memcpy(ckpt.magic, "SDC2", 4);
+	strncpy(ckpt.path, path, MAXPATH);
+	ckpt.path[MAXPATH] = '\0';
+	strcpy(ckpt.volname, volname);
+	ckpt.totblks = totblks;
+	ckpt.errcount = errcount;
+	ckpt.errstart = errstart;
+	ckpt.flchanged = flchanged;
+	ckpt.ndirs = 0;
+	for (d = dirs; d; d = d->next)
+		++ckpt.ndirs;
+	ckpt.dowholedisk = dowholedisk;
+	ckpt.dorecurse = dorecurse;
+	ckpt.dowrite = dowrite;
+#ifdef CHECK
+	ckpt.dobatch = dobatch;
+#endif
+#ifdef LAYOUT
+	ckpt.dolayout = dolayout;
+#endif
+#ifdef MOVEDIR
+	ckpt.domovedirs = domovedirs;
+#endif
+#ifdef MOVEFILE
+	ckpt.domovefiles = domovefiles;
+#endif
+	ckpt.dozero = dozero;
+#ifdef SURFACE
+	ckpt.dosurface = dosurface;
+	ckpt.nbad = nbad;
+	memcpy(ckpt.badblks, badblks, sizeof(badblks));
+#endif
+#ifdef MANIFEST
+	ckpt.dohash = dohash;
+	strcpy(ckpt.mfdir, mfdir);
+#endif
+	memcpy(ckpt.sortopts, sortopts, NLEVELS+1);
+	memcpy(ckpt.caseopts, caseopts, 2);
+	memcpy(ckpt.fixopts, fixopts, 2);
+	memcpy(ckpt.dateopts, dateopts, 2);
+	fd = open(ckptpath, O_WRONLY | O_CREAT | O_TRUNC);
+	if (fd == -1)
+		goto bad;
+	if (write(fd, &ckpt, sizeof(ckpt)) != sizeof(ckpt))
+		goto bad;
+	for (d = dirs; d; d = d->next) {
+		((uint*)buf)[i++] = d->blocknum;
+		if ((i == BLKSZ / 2) || !d->next) {
+			if (write(fd, buf, i * 2) != i * 2)
+				goto bad;
+			i = 0;
+		}
+	}
+	if (ckptaux(fd, usedlist, 1) == -1)
+		goto bad;
+	if (flchanged && (ckptaux(fd, freelist, 1) == -1))
+		goto bad;
+	close(fd);
+	if (doverbose)
+		printf("Checkpoint saved, %u dirs pending\n", ckpt.ndirs);
+	return 0;
+bad:
+	if (fd != -1) {
+		close(fd);
+		remove(ckptpath);
+	}
+	printf(err_ckpt1, ckptpath);
+	putchar('\n');
+	return -1;
+}
+
+#ifdef OVERLAYS
+#pragma code-name (push, "OVERLAY1")
+#pragma rodata-name (push, "OVERLAY1")
+#endif
+/*
+ * Read the checkpoint file header and, if it is valid, ask whether to
+ * resume.  If so, the saved options are restored and the start path is
+ * copied to buf.  Returns 1 to resume, 0 otherwise.
+ */
+uchar askresume(void) {
+	int fd, n;
+	char r;
+	fd = open(ckptpath, O_RDONLY);
+	if (fd == -1)
+		return 0;
+	n = read(fd, &ckpt, sizeof(ckpt));
+	close(fd);
+	if ((n != sizeof(ckpt)) || strncmp(ckpt.magic, "SDC2", 4))
+		return 0;
+	printf("\nCheckpoint for %s: %u dirs pending, %u errors\n",
+	       ckpt.path, ckpt.ndirs, ckpt.errcount);
+	subtitle("Resume from checkpoint?");
+	do {
+		fputs("| [-] No         | [r] Resume              |                                   |", stderr);
+		r = getchar();
+	} while (strchr("-r", r) == NULL);
+	if (r == '-')
+		return 0;
+	dowholedisk = ckpt.dowholedisk;
+	dorecurse = ckpt.dorecurse;
+	dowrite = ckpt.dowrite;
+#ifdef CHECK
+	dobatch = ckpt.dobatch;
+#endif
+#ifdef LAYOUT
+	dolayout = ckpt.dolayout;
+#endif
+#ifdef MOVEDIR
+	domovedirs = ckpt.domovedirs;
+#endif
+#ifdef MOVEFILE
+	domovefiles = ckpt.domovefiles;
+#endif
+	dozero = ckpt.dozero;
+#ifdef SURFACE
+	dosurface = ckpt.dosurface;
+#endif
+#ifdef MANIFEST
+	dohash = ckpt.dohash;
+	strcpy(mfdir, ckpt.mfdir);
+#endif
+	memcpy(sortopts, ckpt.sortopts, NLEVELS+1);
+	memcpy(caseopts, ckpt.caseopts, 2);
+	memcpy(fixopts, ckpt.fixopts, 2);
+	memcpy(dateopts, ckpt.dateopts, 2);
+	errcount = ckpt.errcount;
+	strcpy(buf, ckpt.path);
+	return 1;
+}
+
+#ifdef OVERLAYS
+#pragma code-name (pop)
+#pragma rodata-name (pop)
+#endif
+
+/*
+ * Restore the pending directories, usedlist and freelist from the
+ * checkpoint file.  If the checkpoint can't be used, the freelist is
+ * read again from device and -1 is returned.  Returns 0 on success.
+ */
+int restorecheckpoint(uchar device) {
+	struct dirblk *d, *prev = NULL;
+	uint i, j, n;
+	int fd;
+	if (strcmp(volname, ckpt.volname) || (totblks != ckpt.totblks)) {
+		puts(err_ckpt3);
+		return -1;
+	}
+	fd = open(ckptpath, O_RDONLY);
+	if (fd == -1)
+		goto bad;
+	if (read(fd, &ckpt, sizeof(ckpt)) != sizeof(ckpt))
+		goto bad;
+	for (i = 0; i < ckpt.ndirs; i += n) {
+		n = ckpt.ndirs - i;
+		if (n > BLKSZ / 2)
+			n = BLKSZ / 2;
+		if (read(fd, buf, n * 2) != n * 2)
+			goto bad;
+		for (j = 0; j < n; ++j) {
+			d = (struct dirblk*)malloc(sizeof(struct dirblk));
+			if (!d)
+				err(FATALALLOC, err_nomem);
+			d->blocknum = ((uint*)buf)[j];
+			d->next = NULL;
+			if (prev)
+				prev->next = d;
+			else
+				dirs = d;
+			prev = d;
+		}
+	}
+	if (ckptaux(fd, usedlist, 0) == -1)
+		goto bad;
+	if (ckpt.flchanged && (ckptaux(fd, freelist, 0) == -1))
+		goto bad;
+	flchanged = ckpt.flchanged;
+	errstart = ckpt.errstart;
+#ifdef SURFACE
+	nbad = ckpt.nbad;
+	memcpy(badblks, ckpt.badblks, sizeof(badblks));
+#endif
+	close(fd);
+	printf("Resuming, %u dirs pending\n", ckpt.ndirs);
+	return 0;
+bad:
+	if (fd != -1)
+		close(fd);
+	printf(err_ckpt2, ckptpath);
+	putchar('\n');
+	while (dirs) {
+		d = dirs;
+		dirs = d->next;
+		free(d);
+	}
+	readfreelist(device);
+	return -1;
+}
+
+#endif
+
+#ifdef REPORT
+
+/*
+ * Open the report file and write the column headings.  A relative path
+ * is made absolute, so the directory containing it can be recognised.
+ */
+void rptopen(void) {
+	uint len = 0;
+	if (rptpath[0] != '/') {
+		getcwd(rptabs, MAXPATH);
+		len = strlen(rptabs);
+		if ((len > 0) && (rptabs[len - 1] != '/'))
+			rptabs[len++] = '/';
+	}
+	strncpy(rptabs + len, rptpath, MAXPATH - len);
+	rptabs[MAXPATH] = '\0';
+	rptdirlen = strrchr(rptabs, '/') - rptabs;
+	rptfd = open(rptabs, O_WRONLY | O_CREAT | O_TRUNC);
+	if (rptfd == -1) {
+		printf(err_rpt1, rptabs);
+		putchar('\n');
+		return;
+	}
+	rptputs("TYPE\tPATH\tENTRIES\tBLOCKS\tERRORS\tFIXES\tWRITTEN\tMESSAGE\n");
+}
+
+/*
+ * Write out the contents of rptbuf[]
+ */
+void rptflush(void) {
+	if ((rptlen > 0) && (write(rptfd, rptbuf, rptlen) != rptlen)) {
+		close(rptfd);
+		rptfd = -1;
+		printf(err_rpt1, rptabs);
+		putchar('\n');
+	}
+	rptlen = 0;
+}
+
+/*
+ * Write out the last partial block and close the report file
+ */
+void rptclose(void) {
+	if (rptfd == -1)
+		return;
+	rptflush();
+	if (rptfd != -1)
+		close(rptfd);
+	rptfd = -1;
+}
+
+/*
+ * Append string s to the report.  Only complete blocks are written, so
+ * each ProDOS write call is a whole block.
+ */
+void rptputs(char *s) {
+	if (rptfd == -1)
+		return;
+	while (*s) {
+		rptbuf[rptlen++] = *s++;
+		if (rptlen == BLKSZ)
+			rptflush();
+		if (rptfd == -1)
+			return;
+	}
+}
+
+/*
+ * Add an error record to the report.  Called from err().
+ */
+void rpterr(const char *fmt, va_list v) {
+	if (rptfd == -1)
+		return;
+	rptputs("ERR\t");
+	rptputs(rptdirpath);
+	rptputs("\t\t\t\t\t\t");
+	vsnprintf(rptline, sizeof(rptline), fmt, v);
+	rptputs(rptline);
+	rptputs("\n");
+}
+
+/*
+ * Add a record for the current directory to the report.  errs, fixes
+ * and wrts are the errors found, fixes applied and blocks written.
+ */
+void rptdir(uint errs, uint fixes, uint wrts) {
+	struct block *b;
+	uint nblks = 0;
+	if (rptfd == -1)
+		return;
+	for (b = blocks; b; b = b->next)
+		++nblks;
+	sprintf(rptline, "DIR\t%s\t%u\t%u\t%u\t%u\t%u\t\n",
+	        rptdirpath, numfiles, nblks, errs, fixes, wrts);
+	rptputs(rptline);
+}
+
+/*
+ * Build the full path of the directory with key block blk in p by
+ * following the parent pointers up to the volume directory.  Uses buf2.
+ * If a block can't be read, p is left empty.
+ */
+void dirpath(uchar device, uint blk, char *p) {
+	struct pd_dirhdr *hdr = (struct pd_dirhdr*)(buf2 + PTRSZ);
+	uint len = 0, n, prev;
+	uchar depth;
+	p[0] = '\0';
+	for (depth = 0; depth < MAXPATH / 2; ++depth) {
+		if (readdiskblock(device, blk, buf2) == -1)
+			goto bad;
+		n = hdr->typ_len & 0x0f;
+		if (len + n + 1 > MAXPATH)
+			return;
+		memmove(p + n + 1, p, len + 1);
+		p[0] = '/';
+		memcpy(p + 1, hdr->name, n);
+		len += n + 1;
+		if ((hdr->typ_len & 0xf0) != 0xe0)
+			return; /* Volume directory, or damaged */
+		/* Parent entry may not be in the parent's key block */
+		blk = hdr->parptr[0] + 256U * hdr->parptr[1];
+		for (n = 0; n < MAXPATH; ++n) {
+			if (readdiskblock(device, blk, buf2) == -1)
+				goto bad;
+			prev = buf2[0] + 256U * buf2[1];
+			if (prev == 0)
+				break;
+			blk = prev;
+		}
+	}
+	return;
+bad:
+	p[0] = '\0';
+}
+
+#endif
+
+#ifdef MANIFEST
+
+/*
+ * Build the CRC-32 lookup tables and store them in aux memory.  Each
+ * 32 bit table entry is split into four 256 byte tables, one per byte,
+ * so the CRC can be updated using only byte operations.  Uses buf, buf2.
+ */
+void crcinit(void) {
+	ulong c;
+	uint i;
+	uchar b;
+	for (i = 0; i < 256; ++i) {
+		c = i;
+		for (b = 0; b < 8; ++b)
+			c = (c & 1) ? (c >> 1) ^ 0xedb88320UL : (c >> 1);
+		buf[i]        = c & 0xff;
+		buf[i + 256]  = (c >> 8) & 0xff;
+		buf2[i]       = (c >> 16) & 0xff;
+		buf2[i + 256] = (c >> 24) & 0xff;
+	}
+	copyaux(buf, crcaux, BLKSZ, TOAUX);
+	copyaux(buf2, crcaux + BLKSZ, BLKSZ, TOAUX);
+}
+
+/*
+ * Add len bytes at p to the CRC in crc[], using the tables in crctab[]
+ */
+void crcblock(uchar *p, uint len) {
+	uchar i;
+	while (len--) {
+		i = crc[0] ^ *p++;
+		crc[0] = crc[1] ^ crctab[i];
+		crc[1] = crc[2] ^ crctab[i + 256];
+		crc[2] = crc[3] ^ crctab[i + 512];
+		crc[3] = crctab[i + 768];
+	}
+}
+
+/*
+ * Add the data blocks listed in index block idx to the CRC, stopping once
+ * *left bytes have been added.  Sparse blocks are counted as zeros.
+ * Uses buf.
+ */
+int crcsapling(uchar device, char *idx, ulong *left) {
+	uint i, p, n;
+	for (i = 0; (i < 256) && (*left > 0); ++i) {
+		p = idx[i] + 256U * idx[i+256];
+		n = (*left > BLKSZ) ? BLKSZ : *left;
+		if (p) {
+			if (readdiskblock(device, p, buf) == -1) {
+				err(NONFATAL, err_rdblk1, p);
+				return -1;
+			}
+		} else
+			bzero(buf, BLKSZ);
+		crcblock((uchar*)buf, n);
+		*left -= n;
+	}
+	return 0;
+}
+
+/*
+ * Add the first eof bytes of a seedling, sapling or tree fork to the CRC.
+ * Unlike the walkers used for checking, which visit blocks in disk order,
+ * this visits them in file order.  Uses buf, buf2 and dirblkbuf.
+ */
+int crcfork(uchar device, uchar type, uint keyblk, ulong eof) {
+	uint i, p;
+	switch (type) {
+	case 0x1:
+		if (readdiskblock(device, keyblk, buf) == -1)
+			goto bad;
+		crcblock((uchar*)buf, (eof > BLKSZ) ? BLKSZ : eof);
+		break;
+	case 0x2:
+		if (readdiskblock(device, keyblk, buf2) == -1)
+			goto bad;
+		return crcsapling(device, buf2, &eof);
+	case 0x3:
+		if (readdiskblock(device, keyblk, dirblkbuf) == -1)
+			goto bad;
+		for (i = 0; (i < 128) && (eof > 0); ++i) {
+			p = dirblkbuf[i] + 256U * dirblkbuf[i+256];
+			if (p) {
+				if (readdiskblock(device, p, buf2) == -1) {
+					keyblk = p;
+					goto bad;
+				}
+			} else
+				bzero(buf2, BLKSZ);
+			if (crcsapling(device, buf2, &eof) == -1)
+				return -1;
+		}
+	}
+	return 0;
+bad:
+	err(NONFATAL, err_rdblk1, keyblk);
+	return -1;
+}
+
+/*
+ * Calculate the CRC-32 of the file with directory entry ent, leaving it
+ * in crc[].  For an extended file, the resource fork follows the data fork.
+ */
+int crcfile(uchar device, struct pd_dirent *ent) {
+	uint keyblk = ent->keyptr[0] + 256U * ent->keyptr[1];
+	uint r_keyblk;
+	ulong eof, r_eof;
+	uchar d_type, r_type;
+	int rc;
+	crc[0] = crc[1] = crc[2] = crc[3] = 0xff;
+	if ((ent->typ_len & 0xf0) == 0x50) {
+		if (readdiskblock(device, keyblk, buf) == -1) {
+			err(NONFATAL, err_rdblk1, keyblk);
+			return -1;
+		}
+		d_type = buf[0x00];
+		keyblk = buf[0x01] + 256U * buf[0x02];
+		eof = buf[0x05] + 256UL * buf[0x06] + 65536UL * buf[0x07];
+		r_type = buf[0x100];
+		r_keyblk = buf[0x101] + 256U * buf[0x102];
+		r_eof = buf[0x105] + 256UL * buf[0x106] + 65536UL * buf[0x107];
+		rc = crcfork(device, d_type, keyblk, eof);
+		if (rc == 0)
+			rc = crcfork(device, r_type, r_keyblk, r_eof);
+	} else {
+		eof = ent->eof[0] + 256UL * ent->eof[1] + 65536UL * ent->eof[2];
+		rc = crcfork(device, ent->typ_len >> 4, keyblk, eof);
+	}
+	crc[0] ^= 0xff;
+	crc[1] ^= 0xff;
+	crc[2] ^= 0xff;
+	crc[3] ^= 0xff;
+	return rc;
+}
+
+/*
+ * Open the old manifest for the current volume, if there is one, and
+ * create the new one.  Manifests are named after the volume and kept
+ * in directory mfdir, which must be on another volume.
+ */
+void mfopen(void) {
+	struct mfhdr h;
+	uint len;
+	mfhashed = mfsame = mfbad = 0;
+	if (onvolume(mfdir)) {
+		puts(err_mf1);
+		return;
+	}
+	strcpy(mfname, mfdir);
+	len = strlen(mfname);
+	if ((len > 0) && (mfname[len - 1] != '/'))
+		mfname[len++] = '/';
+	strcpy(mftmp, mfname);
+	strcpy(mfname + len, volname);
+	strcpy(mftmp + len, "SORTDIR.NEW");
+	mfold = open(mfname, O_RDONLY);
+	if (mfold != -1) {
+		if ((read(mfold, &h, sizeof(h)) != sizeof(h)) ||
+		    strncmp(h.magic, "SDM2", 4) ||
+		    strcmp(h.volname, volname) || (h.totblks != totblks)) {
+			printf(err_mf2, mfname);
+			putchar('\n');
+			close(mfold);
+			mfold = -1;
+		}
+	}
+	memcpy(h.magic, "SDM2", 4);
+	strcpy(h.volname, volname);
+	h.totblks = totblks;
+	mfnew = open(mftmp, O_WRONLY | O_CREAT | O_TRUNC);
+	if ((mfnew != -1) && (write(mfnew, &h, sizeof(h)) != sizeof(h))) {
+		close(mfnew);
+		mfnew = -1;
+	}
+	if (mfnew == -1) {
+		printf(err_mf3, mftmp);
+		putchar('\n');
+		if (mfold != -1)
+			close(mfold);
+		mfold = -1;
+	}
+}
+
+/*
+ * Append len bytes at p to the new manifest, a block at a time
+ */
+void mfput(void *p, uint len) {
+	char *q = (char*)p;
+	while (len--) {
+		mfbuf[mflen++] = *q++;
+		if (mflen == BLKSZ)
+			mfflush();
+	}
+}
+
+/*
+ * Write out the contents of mfbuf[]
+ */
+void mfflush(void) {
+	if ((mflen > 0) && (mfnew != -1) &&
+	    (write(mfnew, mfbuf, mflen) != mflen)) {
+		printf(err_mf3, mftmp);
+		putchar('\n');
+		close(mfnew);
+		remove(mftmp);
+		mfnew = -1;
+	}
+	mflen = 0;
+}
+
+/*
+ * Load up to max records for directory dirblk from the old manifest into
+ * recs[].  Directories are usually found in the order they were written,
+ * otherwise the file is searched from the start.
+ * Returns the number of records loaded.
+ */
+uint mfload(uint dirblk, struct mfrec *recs, uint max) {
+	struct mfgroup g;
+	long start;
+	uint n;
+	uchar pass;
+	if (mfold == -1)
+		return 0;
+	start = lseek(mfold, 0, SEEK_CUR);
+	for (pass = 0; pass < 2; ++pass) {
+		while (read(mfold, &g, sizeof(g)) == sizeof(g)) {
+			if (g.dirblk == dirblk) {
+				n = (g.count > max) ? max : g.count;
+				if (read(mfold, recs, n * sizeof(struct mfrec)) !=
+				    n * sizeof(struct mfrec))
+					return 0;
+				lseek(mfold, (long)(g.count - n) * sizeof(struct mfrec),
+				      SEEK_CUR);
+				return n;
+			}
+			lseek(mfold, (long)g.count * sizeof(struct mfrec), SEEK_CUR);
+		}
+		lseek(mfold, sizeof(struct mfhdr), SEEK_SET);
+	}
+	lseek(mfold, start, SEEK_SET);
+	return 0;
+}
+
+/*
+ * Returns 1 if storage type is a seedling, sapling, tree or extended file
+ */
+uchar ishashable(uchar type) {
+	return ((type >= 0x1) && (type <= 0x3)) || (type == 0x5);
+}
+
+/*
+ * Add the files in the current directory, which has key block dirblk, to
+ * the new manifest.  Files are matched with the old manifest by name, and
+ * are only hashed if they are new, their mtime, EOF or blocks used have
+ * changed, or dohash is 2.  Uses filelist[] as
+ * scratch space, so must be called before buildsorttable().
+ */
+void hashdir(uchar device, uint dirblk) {
+	static char namebuf[NMLEN+1];
+	struct mfgroup g;
+	struct mfrec rec, *old, *o;
+	struct pd_dirent *ent;
+	struct block *b;
+	char *dirbuf;
+	uint nold, max, i, last = 0;
+	uchar e, same;
+	mfgrppos = -1;
+	if ((mfnew == -1) || (maxfiles * sizeof(struct fileent) < 2048))
+		return;
+	crctab = (uchar*)filelist;
+	dirbuf = (char*)filelist + 1024;
+	mfbuf = (char*)filelist + 1536;
+	old = (struct mfrec*)((char*)filelist + 2048);
+	max = (maxfiles * sizeof(struct fileent) - 2048) / sizeof(struct mfrec);
+	copyaux(crcaux, (char*)crctab, 1024, FROMAUX);
+	mflen = 0;
+
+	/* Count the files first, for the group header */
+	g.dirblk = dirblk;
+	g.count = 0;
+	for (b = blocks; b; b = b->next) {
+		copyaux(b->data, dirbuf, BLKSZ, FROMAUX);
+		for (e = (b == blocks ? 1 : 0); e < entperblk; ++e) {
+			ent = (struct pd_dirent*)(dirbuf + PTRSZ + e * entsz);
+			if (ishashable(ent->typ_len >> 4))
+				++g.count;
+		}
+	}
+	mfgrppos = lseek(mfnew, 0, SEEK_CUR);
+	mfput(&g, sizeof(g));
+	nold = mfload(dirblk, old, max);
+
+	for (b = blocks; b; b = b->next) {
+		copyaux(b->data, dirbuf, BLKSZ, FROMAUX);
+		for (e = 0; e < entperblk; ++e) {
+			if ((b == blocks) && (e == 0))
+				continue; /* Directory header */
+			ent = (struct pd_dirent*)(dirbuf + PTRSZ + e * entsz);
+			if (!ishashable(ent->typ_len >> 4))
+				continue;
+			/* Names survive sorting and moving, unlike entry numbers
+			 * and key blocks */
+			crc[0] = crc[1] = crc[2] = crc[3] = 0xff;
+			crcblock((uchar*)ent->name, ent->typ_len & 0x0f);
+			memcpy(rec.namecrc, crc, 4);
+			memcpy(rec.mtime, ent->mtime, 4);
+			memcpy(rec.eof, ent->eof, 3);
+			memcpy(rec.blksused, ent->blksused, 2);
+
+			/* Files are usually in the same order as last time */
+			o = NULL;
+			for (i = 0; i < nold; ++i) {
+				if (!memcmp(old[(last + i) % nold].namecrc,
+				            rec.namecrc, 4)) {
+					last = (last + i) % nold;
+					o = &old[last];
+					break;
+				}
+			}
+			same = (o && !memcmp(o->mtime, rec.mtime, 4) &&
+			        !memcmp(o->eof, rec.eof, 3) &&
+			        !memcmp(o->blksused, rec.blksused, 2));
+			if (same && (dohash == 1)) {
+				memcpy(rec.crc, o->crc, 4);
+				++mfsame;
+			} else {
+				bzero(namebuf, NMLEN+1);
+				memcpy(namebuf, ent->name, ent->typ_len & 0x0f);
+				if (dodebug)
+					printf("Hashing %s\n", namebuf);
+				crcfile(device, ent);
+				++mfhashed;
+				memcpy(rec.crc, crc, 4);
+				if (same && memcmp(o->crc, crc, 4)) {
+					err(NONFATAL, err_crc1, namebuf);
+					/* Keep the original CRC, so it is reported again */
+					memcpy(rec.crc, o->crc, 4);
+					++mfbad;
+				}
+			}
+			mfput(&rec, sizeof(rec));
+		}
+	}
+	mfflush();
+}
+
+/*
+ * The directory last added to the new manifest has been moved to key
+ * block dirblk, so update its group to match
+ */
+void mfmoved(uint dirblk) {
+	if ((mfnew == -1) || (mfgrppos == -1))
+		return;
+	if ((lseek(mfnew, mfgrppos, SEEK_SET) == -1) ||
+	    (write(mfnew, &dirblk, sizeof(dirblk)) != sizeof(dirblk)) ||
+	    (lseek(mfnew, 0, SEEK_END) == -1)) {
+		printf(err_mf3, mftmp);
+		putchar('\n');
+		close(mfnew);
+		remove(mftmp);
+		mfnew = -1;
+	}
+}
+
+/*
+ * Close the manifests, replacing the old manifest with the new one
+ */
+void mfclose(void) {
+	if (mfold != -1)
+		close(mfold);
+	mfold = -1;
+	if (mfnew == -1)
+		return;
+	close(mfnew);
+	mfnew = -1;
+	remove(mfname);
+	if (rename(mftmp, mfname) != 0) {
+		printf(err_mf3, mfname);
+		putchar('\n');
+	}
+	printf("Manifest: %u files hashed, %u unchanged, %u CRC mismatches\n",
+	       mfhashed, mfsame, mfbad);
+}
+
+#endif
+
+#ifdef SURFACE
+
+/*
+ * Returns 1 if blk was found to be unreadable by the surface scan.
+ * Binary search of badblks[], which is in ascending order.
+ */
+uchar isbad(uint blk) {
+	uint lo = 0, hi = nbad, mid;
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (badblks[mid] == blk)
+			return 1;
+		if (badblks[mid] < blk)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return 0;
+}
+
+#ifdef OVERLAYS
+#pragma code-name (push, "OVERLAY2")
+#pragma rodata-name (push, "OVERLAY2")
+#endif
+/*
+ * Read every block on the volume in ascending order, recording those
+ * which can't be read in badblks[].  The ProDOS 5.25" format interleaves
+ * the sectors so that ascending block reads catch each block as it comes
+ * round, so nothing but the read is done between blocks, and failed
+ * blocks are retried after the pass rather than costing revolutions
+ * in the middle of it.  Uses buf.
+ */
+void surfacescan(void) {
+	uint blk, i, j, lost = 0;
+	uchar r;
+	nbad = 0;
+	printf("Surface scan of %u blks\n", totblks);
+	for (blk = 0; blk < totblks; ++blk) {
+		if (dio_read(dio_hdl, blk, buf)) {
+			if (nbad < MAXBAD)
+				badblks[nbad++] = blk;
+			else
+				++lost;
+		}
+		if ((blk & 0xff) == 0xff)
+			printf("\r%u", blk + 1);
+	}
+	printf("\r%u\n", totblks);
+	for (i = j = 0; i < nbad; ++i) {
+		for (r = 0; r < NRETRY; ++r)
+			if (dio_read(dio_hdl, badblks[i], buf) == 0)
+				break;
+		if (r < NRETRY)
+			printf("Blk %u read OK after %u retries\n", badblks[i], r + 1);
+		else
+			badblks[j++] = badblks[i];
+	}
+	nbad = j;
+	for (i = 0; i < nbad; ++i)
+		err(NONFATAL, err_rdblk1, badblks[i]);
+	if (lost)
+		err(NONFATAL, err_bad1, MAXBAD);
+	printf("\n%u unreadable blks\n", nbad + lost);
+}
+
+/*
+ * After the volume has been walked, report unreadable blocks which
+ * no file or directory was found to be using
+ */
+void surfacedone(void) {
+	uint i, n = 0;
+	for (i = 0; i < nbad; ++i) {
+		if (!isused(badblks[i])) {
+			printf("Unreadable blk %u is not in use\n", badblks[i]);
+			++n;
+		}
+	}
+	printf("%u unreadable blks in use, %u not in use\n", nbad - n, n);
+	nbad = 0;
+}
+#ifdef OVERLAYS
+#pragma code-name (pop)
+#pragma rodata-name (pop)
+#endif
+
+#endif
+
+#ifdef OVERLAYS
+#pragma code-name (push, "OVERLAY1")
+#pragma rodata-name (push, "OVERLAY1")
+#endif
+
 #ifdef CMDLINE
 
 void usage(void) {
-	printf("usage: sortdir [-s xxx] [-n x] [-rDwvVh] path\n\n");
+	printf("usage: sortdir [-s xxx] [-n x] [-c file] [-o file] [-k dir] [-rDwblmMzZSvVh] path...\n\n");
 	printf("  Options: -s xxx  Directory sort options\n");
 	printf("           -n x    Filename upper/lower case options\n");
 	printf("           -d x    Date format conversion options\n");
@@ -2347,11 +5001,24 @@ void usage(void) {
 	printf("           -r      Recursive descent\n");
 	printf("           -D      Whole-disk mode (implies -r)\n");
 	printf("           -w      Enable writing to disk\n");
+	printf("           -b      Batch tree index reads per dir\n");
+	printf("           -l      Fragmentation/layout analysis\n");
+	printf("           -m      Move dirs to contiguous blks\n");
+	printf("           -M      Move fragmented files\n");
 	printf("           -z      Zero free space\n");
+	printf("           -Z      Zero free space, skip blks already 0\n");
+	printf("           -S      Surface scan (implies -D)\n");
+	printf("           -c file Checkpoint file, offers to resume\n");
+	printf("           -o file Tab separated report file\n");
+	printf("           -k dir  CRC-32 manifest, hash changed files\n");
+	printf("           -K dir  CRC-32 manifest, verify all files\n");
 	printf("           -v      Verbose output\n");
 	printf("           -V      Verbose debugging output\n");
 	printf("           -h      This help\n");
 	printf("\n");
+	printf("path may be * for all online volumes, or @file to\n");
+	printf("read paths from a text file, one per line.\n");
+	printf("\n");
 	printf("-nx: Upper/lower case filenames, where x is:\n");
 	printf("  l  convert filenames to lower case           eg: read.me\n");
 	printf("  u  convert filenames to upper case           eg: READ.ME\n");
@@ -2494,6 +5161,11 @@ s3d1:
   --(*devcnt);
 }
 
+#ifdef OVERLAYS
+#pragma code-name (pop)
+#pragma rodata-name (pop)
+#endif
+
 //
 // No point in reconnecting the RAMdisk(s) since we reboot on exit
 //
@@ -2567,15 +5239,57 @@ done:
 }
 #pragma optimize (on)
 
+#ifdef OVERLAYS
+
+/*
+ * The overlay files are in the same directory as SORTDIR.SYSTEM, whose
+ * pathname ProDOS leaves at $280.  Must be called before $280 is used.
+ */
+void findoverlays(void) {
+	uchar *p = (uchar*)0x280;
+	uchar i, len = p[0] & 0x7f;
+	if (len > MAXPATH - NMLEN)
+		len = 0;
+	ovldirlen = 0;
+	for (i = 0; i < len; ++i) {
+		ovlpath[i] = p[i + 1] & 0x7f;
+		if (ovlpath[i] == '/')
+			ovldirlen = i + 1;
+	}
+}
+
+/*
+ * Load overlay n (1 or 2) from SORTDIR.OVn to its run address.  Both
+ * overlays run at the top of the heap, in memory which belongs to
+ * filelist[] once it has been allocated, so overlay 1 can only be used
+ * before then and overlay 2 must be loaded again each time it is needed.
+ */
+void loadoverlay(uchar n) {
+	int fd;
+	uint len = (n == 1) ? (size_t)_OVERLAY1_SIZE__ : (size_t)_OVERLAY2_SIZE__;
+	void *addr = (n == 1) ? _OVERLAY1_LOAD__ : _OVERLAY2_LOAD__;
+	sprintf(ovlpath + ovldirlen, "SORTDIR.OV%u", n);
+	fd = open(ovlpath, O_RDONLY);
+	if (fd == -1)
+		err(FATAL, err_ovl, ovlpath);
+	if (read(fd, addr, len) != len)
+		err(FATAL, err_ovl, ovlpath);
+	close(fd);
+}
+
+#endif
+
 //int main(int argc, char *argv[]) {
 int main() {
 #ifdef CMDLINE
 	int opt;
 #endif
-	uchar dev;
-	uint blk;
-
 	uchar *pp;
+	void *slack;
+	uchar nslack = 0;
+#ifdef OVERLAYS
+	findoverlays();
+#endif
 	pp = (uchar*)0xbf98;
 	if (!(*pp & 0x02))
 		err(FATAL, err_80col);
@@ -2612,6 +5326,13 @@ int main() {
 
 #endif
 
+#ifdef MANIFEST
+	crcaux = auxalloc(1024);
+#endif
+#ifdef OWNERMAP
+	ownmap = auxalloc2(OWNMAPBLKS * 3);
+#endif
+
 #ifdef AUXMEM
 	lockaux(); // Protect free list and used list
 #endif
@@ -2619,8 +5340,17 @@ int main() {
 	buf =  (char*)malloc(sizeof(char) * BLKSZ);
 	buf2 =  (char*)malloc(sizeof(char) * BLKSZ);
 	dirblkbuf = (char*)malloc(sizeof(char) * BLKSZ);
+#ifdef REPORT
+	rptbuf = (char*)malloc(sizeof(char) * BLKSZ);
+#endif
+#ifdef OWNERMAP
+	ownbuf = (char*)malloc(sizeof(char) * BLKSZ);
+#endif
 	//printf("\nHeap: %u %u\n", _heapmemavail(), _heapmaxavail());
-	maxfiles = _heapmaxavail() / sizeof(struct fileent);
+
+#ifdef OVERLAYS
+	loadoverlay(1); // Startup code, until filelist[] is allocated
+#endif
 
 #ifdef AUXMEM
     disconnect_ramdisk();
@@ -2629,8 +5359,6 @@ int main() {
 	//rebootafterexit(); // Necessary if we were called from BASIC
 
     clrscr();
-	printf("[%u]\n", maxfiles);
-	filelist = (struct fileent*)malloc(sizeof(struct fileent) * maxfiles);
 
 #ifdef CMDLINE
 	parseargs();
@@ -2642,7 +5370,7 @@ int main() {
 	else {
 		if (argc < 2)
 			usage();
-		while ((opt = getopt(argc, argv, "DrwvVzs:n:f:d:h")) != -1) {
+		while ((opt = getopt(argc, argv, "DrwblmMvVzZSs:n:f:d:c:o:k:K:h")) != -1) {
 			switch (opt) {
 			case 'D':
 				dowholedisk = 1;
@@ -2654,6 +5382,26 @@ int main() {
 			case 'w':
 				dowrite = 1;
 				break;
+#ifdef CHECK
+			case 'b':
+				dobatch = 1;
+				break;
+#endif
+#ifdef LAYOUT
+			case 'l':
+				dolayout = 1;
+				break;
+#endif
+#ifdef MOVEDIR
+			case 'm':
+				domovedirs = 1;
+				break;
+#endif
+#ifdef MOVEFILE
+			case 'M':
+				domovefiles = 1;
+				break;
+#endif
 			case 'v':
 				doverbose = 1;
 				break;
@@ -2665,6 +5413,18 @@ int main() {
 				dowholedisk = 1;
 				dorecurse = 1;
 				break;
+			case 'Z':
+				dozero = 2;
+				dowholedisk = 1;
+				dorecurse = 1;
+				break;
+#ifdef SURFACE
+			case 'S':
+				dosurface = 1;
+				dowholedisk = 1;
+				dorecurse = 1;
+				break;
+#endif
 			case 's':
 				strncpy(sortopts, optarg, NLEVELS);
 				break;
@@ -2677,13 +5437,39 @@ int main() {
 			case 'd':
 				strncpy(dateopts, optarg, 1);
 				break;
+#ifdef CHECKPOINT
+			case 'c':
+				strncpy(ckptpath, optarg, MAXPATH);
+				break;
+#endif
+#ifdef REPORT
+			case 'o':
+				strncpy(rptpath, optarg, MAXPATH);
+				break;
+#endif
+#ifdef MANIFEST
+			case 'k':
+			case 'K':
+				dohash = (opt == 'k') ? 1 : 2;
+				strncpy(mfdir, optarg, MAXPATH);
+				break;
+#endif
 			case 'h':
 			default:
 				usage();
 		}
 	}
 
+#ifdef CHECKPOINT
+	if (ckptpath[0])
+		doresume = askresume();
+	if (!doresume)
+#endif
+#ifdef JOBS
+	if (optind > argc - 1)
+#else
 	if (optind != argc - 1)
+#endif
 		usage();
 	}
 #else
@@ -2692,35 +5478,91 @@ int main() {
 
 #endif
 
-#ifdef CMDLINE
-	firstblk(((argc == 1) ? buf : argv[optind]), &dev, &blk);
+#ifdef REPORT
+	/* Open before filelist[] is allocated, as it stays open throughout */
+	if (rptpath[0])
+		rptopen();
+#endif
+
+	/*
+	 * Overlay 1 is finished with, so filelist[] can have its memory,
+	 * less room for the files which are opened later on.  Overlay 2 and
+	 * the checkpoint are opened one at a time, the manifests together.
+	 */
+#if defined(OVERLAYS) || defined(CHECKPOINT)
+	nslack = 1;
+#endif
+#ifdef MANIFEST
+	if (dohash)
+		nslack += 2;
+#endif
+	slack = (nslack ? malloc(nslack * IOSLACK) : NULL);
+	maxfiles = _heapmaxavail() / sizeof(struct fileent);
+	filelist = (struct fileent*)malloc(sizeof(struct fileent) * maxfiles);
+	free(slack);
+#ifdef OVERLAYS
+	printf("[%u, %u from overlays]\n", maxfiles,
+	       (uint)(((size_t)_OVERLAY1_SIZE__ + (size_t)_OVERLAY2_SIZE__ -
+	               IOSLACK) / sizeof(struct fileent)));
 #else
-	firstblk(buf, &dev, &blk);
+	printf("[%u]\n", maxfiles);
+#endif
+#ifdef CHECK
+	idxlist = (struct idxblk*)filelist;
+	maxidx = (sizeof(struct fileent) * maxfiles) / sizeof(struct idxblk);
 #endif
 
-#ifdef FREELIST
-	readfreelist(dev);
+#ifdef MOVEDIR
+	/* Directories are moved as they are written, so make sure they are */
+	if (domovedirs && (strlen(sortopts) == 0))
+		sortopts[0] = '.';
 #endif
-	if (dowholedisk)
-		processdir(dev, 2);
-	else
-		processdir(dev, blk);
-	if (dorecurse) {
-		while (dirs) {
-			struct dirblk *d = dirs;
-			blk = dirs->blocknum;
-			dirs = d->next;
-			free(d);
-			processdir(dev, blk);
-		}
-	}
-#ifdef FREELIST
-	if (dowholedisk) {
-		checkfreeandused(dev);
-		if (dowrite && flchanged)
-			writefreelist(dev);
+#ifdef MOVEFILE
+	/* Moving files updates the key pointers, so dirs must be written */
+	if (domovefiles && (strlen(sortopts) == 0))
+		sortopts[0] = '.';
+#endif
+
+#ifdef SURFACE
+	/* Batched index reads lose track of which file owns each block */
+	if (dosurface)
+		dobatch = 0;
+#endif
+
+#ifdef MANIFEST
+	if (dohash)
+		crcinit();
+#endif
+
+#ifdef CHECKPOINT
+	/* Resuming carries on with the start path saved in the checkpoint */
+	if (doresume) {
+		processtarget(buf);
+		err(FINISHED, "");
 	}
+#endif
+
+#ifdef JOBS
+	/* Copy the paths, as buf is about to be used for disk I/O */
+#ifdef CMDLINE
+	if (argc == 1)
+		addtarget(NULL, buf);
+	else
+		for (opt = optind; opt < argc; ++opt)
+			addtarget(NULL, argv[opt]);
+#else
+	addtarget(NULL, buf);
+#endif
+	processjobs();
+#else
+#ifdef CMDLINE
+	processtarget((argc == 1) ? buf : argv[optind]);
+#else
+	processtarget(buf);
+#endif
+#endif
 
+#ifdef FREELIST
 //  reconnect_ramdisk();  /// CRASHES
 	free(freelist);
 //	free(usedlist);  /// TODO This is crashing ATM
@@ -0,0 +1,260 @@
+#!/usr/bin/env python3
+
+###########################################################################
+# Load generator and trace replay for VEServer
+#
+# Acts as one or more Apple II clients running VEDRIVE.SYSTEM, sending
+# read and write requests over UDP and timing the responses, so changes to
+# veserver.py can be measured without an Apple II.  Requests are either
+# made up (a random mix of reads and writes) or replayed from a trace file
+# recorded by veserver.py --trace.
+#
+# Writes really are written, so point it at scratch disk images.
+#
+###########################################################################
+
+host = "::1"        # Server to load --host
+port = 6502         # Server UDP port --port
+clients = 1         # Concurrent clients --clients
+count = 1000        # Requests per client --count
+duration = None     # Secs to run for, instead of count --duration
+writes = 0.1        # Fraction of requests which are writes --writes
+loss = 0.0          # Fraction of packets lost each way --loss
+blocks = 280        # Blocks chosen from, 280 for a 140K floppy --blocks
+drive = 1           # Drive to use --drive2 for drive 2
+timeout = 0.25      # Secs before a request is retransmitted --timeout
+replay = None       # Trace file to replay --replay
+paced = False       # Replay with recorded timing --paced
+
+###########################################################################
+
+import socket
+import time
+import getopt
+import sys
+import random
+import threading
+from functools import reduce
+from operator import xor
+
+BLKSZ = 512
+MAXTRIES = 20   # Sends before a request is given up
+
+#
+# One simulated client, with a socket of its own, which makes its requests
+# one at a time, as VEDRIVE.SYSTEM does, retransmitting on timeout
+#
+class Client:
+    def __init__(self, addr, reqs):
+        self.addr = addr        # Server address
+        self.reqs = reqs        # Iterator of (secs, opcode, blknum, data)
+        self.sock = socket.socket(addr[0], socket.SOCK_DGRAM)
+        self.lat = []           # Round trip time of each request, secs
+        self.rbytes = 0         # Bytes read
+        self.wbytes = 0         # Bytes written
+        self.resends = 0        # Requests sent again after a timeout
+        self.stale = 0          # Responses to earlier requests, discarded
+        self.errors = 0         # Requests answered with an error
+        self.failed = 0         # Requests given up after MAXTRIES
+        self.packets = set()    # Packet numbers seen for current request
+
+    # Build the request packet for opcode and blknum
+    def packet(self, op, blknum, data):
+        hdr = [0xc5, op, blknum & 0xff, blknum >> 8]
+        hdr.append(reduce(xor, hdr, 0))    # Header checksum
+        if op in (0x02, 0x04):
+            return bytes(hdr) + data + bytes([reduce(xor, data, 0)])
+        return bytes(hdr)
+
+    # Check response r to request op, blknum.  Returns True if it answers
+    # the request, False if it is for some other request.
+    def check(self, r, op, blknum, data):
+        if (len(r) < 6) or (r[1] != 0xc5) or (r[2] != op) or \
+           (r[3] + 256 * r[4] != blknum):
+            return False
+        if op in (0x02, 0x04):
+            if r[5] != reduce(xor, data, 0):
+                self.errors += 1
+            else:
+                self.wbytes += BLKSZ
+            return True
+        if len(r) < 11:
+            return False
+        if (reduce(xor, r[1:10], 0) != 0) or (len(r) != 11 + BLKSZ) or \
+           (reduce(xor, r[10:10 + BLKSZ], 0) != r[10 + BLKSZ]):
+            self.errors += 1        # Read error, or damaged response
+        else:
+            self.rbytes += BLKSZ
+        return True
+
+    # Send a request and wait for its response, retransmitting as needed
+    def request(self, op, blknum, data):
+        pkt = self.packet(op, blknum, data)
+        t0 = time.perf_counter()
+        self.packets.clear()
+        for tries in range(MAXTRIES):
+            if tries:
+                self.resends += 1
+            if random.random() >= loss:
+                self.sock.sendto(pkt, self.addr[4])
+            deadline = time.perf_counter() + timeout
+            while True:
+                wait = deadline - time.perf_counter()
+                if wait <= 0:
+                    break
+                self.sock.settimeout(wait)
+                try:
+                    r = self.sock.recv(1024)
+                except socket.timeout:
+                    break
+                if random.random() < loss:
+                    continue        # Lost on the way back
+                if self.check(r, op, blknum, data) and \
+                   (r[0] not in self.packets):
+                    self.packets.add(r[0])
+                    self.lat.append(time.perf_counter() - t0)
+                    return
+                self.stale += 1
+        self.failed += 1
+
+    def run(self):
+        start = time.perf_counter()
+        for secs, op, blknum, data in self.reqs:
+            if paced:
+                wait = start + secs - time.perf_counter()
+                if wait > 0:
+                    time.sleep(wait)
+            self.request(op, blknum, data)
+        self.sock.close()
+
+#
+# Made up requests: reads and writes of random blocks, count of them or
+# for duration secs
+#
+def mix():
+    rd = 0x03 if drive == 1 else 0x05
+    wr = 0x02 if drive == 1 else 0x04
+    end = time.perf_counter() + duration if duration else None
+    n = 0
+    while (n < count) if end is None else (time.perf_counter() < end):
+        blknum = random.randrange(blocks)
+        if random.random() < writes:
+            yield (0, wr, blknum, random.randbytes(BLKSZ))
+        else:
+            yield (0, rd, blknum, b'')
+        n += 1
+
+#
+# Read a trace file recorded by veserver.py --trace.  Returns a list of
+# requests, as (secs, opcode, blknum, data), for each client (address and
+# port) in the trace.  Each image has a worker thread of its own in the
+# server, so a client's requests are put back in the order received.
+#
+def readtrace(filename):
+    streams = {}
+    with open(filename) as f:
+        for line in f:
+            w = line.split()
+            if len(w) < 4:
+                continue
+            op = int(w[2], 16)
+            data = bytes.fromhex(w[4]) if len(w) > 4 else b''
+            streams.setdefault(w[1], []).append(
+                (float(w[0]), op, int(w[3]), data))
+    return [sorted(s, key=lambda r: r[0]) for s in streams.values()]
+
+#
+# Value at fraction q of the way through sorted list l
+#
+def percentile(l, q):
+    return l[min(int(len(l) * q), len(l) - 1)] if l else 0
+
+def report(cl, secs):
+    lat = sorted(x for c in cl for x in c.lat)
+    rbytes = sum(c.rbytes for c in cl)
+    wbytes = sum(c.wbytes for c in cl)
+    print('{} requests from {} clients in {:.2f} secs, {:.0f} requests/sec'.
+          format(len(lat), len(cl), secs, len(lat) / secs))
+    print('Read {:.1f} KB/sec, wrote {:.1f} KB/sec'.format(
+          rbytes / secs / 1024, wbytes / secs / 1024))
+    print('Latency p50 {:.3f} ms, p99 {:.3f} ms, max {:.3f} ms'.format(
+          percentile(lat, 0.5) * 1000, percentile(lat, 0.99) * 1000,
+          (lat[-1] if lat else 0) * 1000))
+    print('{} resent, {} stale responses, {} errors, {} given up'.format(
+          sum(c.resends for c in cl), sum(c.stale for c in cl),
+          sum(c.errors for c in cl), sum(c.failed for c in cl)))
+
+def usage():
+    print('usage: veload [OPTION]...')
+    print('  -h, --help               Show this help');
+    print('  -H HOST, --host=HOST     Server to load (default ::1)');
+    print('  -p PORT, --port=PORT     Server UDP port (default 6502)');
+    print('  -n N, --clients=N        Run N clients at once (default 1)');
+    print('  -c N, --count=N          Make N requests per client (default 1000)');
+    print('  -d SECS, --duration=SECS  Make requests for SECS, not --count');
+    print('  -w FRAC, --writes=FRAC   Fraction of requests which are writes');
+    print('                           (default 0.1)');
+    print('  -l FRAC, --loss=FRAC     Drop FRAC of packets each way (default 0)');
+    print('  -b N, --blocks=N         Use blocks 0 to N-1 (default 280)');
+    print('  -2, --drive2             Use drive 2 rather than drive 1');
+    print('  -t SECS, --timeout=SECS  Resend requests after SECS (default 0.25)');
+    print('  -r FILE, --replay=FILE   Replay trace recorded by veserver --trace,');
+    print('                           one client for each client in the trace');
+    print('  -P, --paced              Replay with the recorded timing, rather');
+    print('                           than as fast as possible');
+
+#
+# Entry point
+#
+
+short_opts = "hH:p:n:c:d:w:l:b:2t:r:P"
+long_opts = ["help", "host=", "port=", "clients=", "count=", "duration=",
+             "writes=", "loss=", "blocks=", "drive2", "timeout=", "replay=",
+             "paced"]
+try:
+    args, vals = getopt.getopt(sys.argv[1:], short_opts, long_opts)
+    for a, v in args:
+        if a in ('-h', '--help'):
+            usage()
+            sys.exit(0)
+        elif a in ('-H', '--host'):
+            host = v
+        elif a in ('-p', '--port'):
+            port = int(v)
+        elif a in ('-n', '--clients'):
+            clients = int(v)
+        elif a in ('-c', '--count'):
+            count = int(v)
+        elif a in ('-d', '--duration'):
+            duration = float(v)
+        elif a in ('-w', '--writes'):
+            writes = float(v)
+        elif a in ('-l', '--loss'):
+            loss = float(v)
+        elif a in ('-b', '--blocks'):
+            blocks = int(v)
+        elif a in ('-2', '--drive2'):
+            drive = 2
+        elif a in ('-t', '--timeout'):
+            timeout = float(v)
+        elif a in ('-r', '--replay'):
+            replay = v
+        elif a in ('-P', '--paced'):
+            paced = True
+except (getopt.error, ValueError) as e:
+    print(str(e))
+    usage()
+    sys.exit(2)
+
+addr = socket.getaddrinfo(host, port, type=socket.SOCK_DGRAM)[0]
+if replay:
+    cl = [Client(addr, iter(s)) for s in readtrace(replay)]
+else:
+    cl = [Client(addr, mix()) for i in range(clients)]
+threads = [threading.Thread(target=c.run) for c in cl]
+start = time.perf_counter()
+for t in threads:
+    t.start()
+for t in threads:
+    t.join()
+report(cl, time.perf_counter() - start)
@@ -15,6 +15,15 @@ file1 = "/home/bobbi/virtual-1.po"  # Disk image drive 1 --disk1 to override
 file2 = "/home/bobbi/virtual-2.po"  # Disk image drive 2 --disk2 to override
 serial_port = None  # Serial port to use instead of ethernet
 baud_rate = 115200  # Baud rate for serial mode
+flush_secs = None   # Secs between flushes, 0 always, None never --flush
+cache_max = 64      # Dirty blks cached per image, 0 write through --cache
+cache_idle = 1.0    # Secs without writes before cache written --idle
+resend_secs = 1.0   # Secs to answer retransmits from cache, 0 off --resend
+readahead = 256     # Blks prefetched per dir or index blk, 0 off --readahead
+verbosity = 'block'  # Log each blk, 'second' summary or 'errors' --verbosity
+metrics_at = None   # Local TCP port or Unix socket path for metrics --metrics
+overlay = False     # Per-client delta files over shared images --overlay
+trace_to = None     # File to record requests to, for veload.py --trace
 
 ###########################################################################
 
@@ -23,10 +32,35 @@ import time
 import os
 import getopt
 import sys
+import mmap
+import signal
+import threading
+import queue
+import itertools
+import array
+import shutil
+import hashlib
+import bisect
+import socketserver
+from http.server import HTTPServer, BaseHTTPRequestHandler
+from collections import Counter
+from functools import reduce
+from operator import xor
 
 IP = "::"
 PORT = 6502
 BLKSZ = 512
+ENTSZ = 0x27    # ProDOS directory entry size
+ENTPERBLK = 13  # ProDOS directory entries per block
+HOTBLKS = 10    # Hottest blocks listed in metrics
+RATEWIN = 60    # Secs over which byte rates are averaged
+LOGQMAX = 1000  # Max items waiting to be logged
+DELTAEXT = '.delta'  # Extension of delta files
+DELTAMAGIC = b'VEDELTA1'  # Identifies a delta file
+DELTAHDR = 16   # Size of delta file header
+DELTADATA = DELTAHDR + 2 * 65536  # Offset of first slot in delta file
+LATBINS = (0.0001, 0.0002, 0.0005, 0.001, 0.002, 0.005, 0.01, 0.02, 0.05,
+           0.1, 0.2, 0.5, 1.0)  # Latency histogram bucket limits, secs
 
 # vt100 colour codes for pretty printing
 BLK = '\033[90m'
@@ -41,14 +75,24 @@ ENDC = '\033[0m'
 
 # Globals
 systemd = False # True if running under Systemd
-packet = 1      # Sent packet counter
+packets = itertools.count(1)  # Sent packet counter
 prevblk = -1    # Last block read/written
 prevdrv = -1    # Last drive read/written
 prevop = -1     # Last operation (read or write)
 prevcs = -1     # Previous checksum
 col = 0         # Used to control logging printout
-skip1 = 0       # Bytes to skip over header (Drive 1)
-skip2 = 0       # Bytes to skip over header (Drive 2)
+logdrv = -1     # Drive of last block logged
+workers = {}    # Worker serving each disk image, by filename
+routes = {}     # Worker for each (client IP, drive), with dir stamp
+stopping = False # True once SIGTERM received
+log_lock = threading.Lock()  # Protects prev*, tally and log_dropped
+log_queue = queue.Queue(LOGQMAX)  # Items for the log writer thread
+log_thread = None # Log writer thread
+log_dropped = 0 # Items dropped because log queue was full
+tally = Counter() # Requests in last sec, by 'R', 'W' and printinfo() mark
+trace_file = None # Requests are recorded here if tracing
+trace_start = 0 # time.perf_counter() when tracing started
+trace_lock = threading.Lock() # Workers take turns to write to trace_file
 
 #
 # Get date/time bytes
@@ -80,32 +124,47 @@ def appendbyte(l, b, csin):
 
 
 #
-# Pretty print info about each request
+# Note each request for logging, on the log writer thread
+# Returns '+' for a repeated request, 'X' for an error, otherwise ' '
 #
 def printinfo(drv, blknum, isWrite, isError, cs, filename):
-    global systemd, prevblk, prevdrv, prevop, prevcs, col
-    if drv != prevdrv:
+    global prevblk, prevdrv, prevop, prevcs
+    with log_lock:
+        e = '+' if ((blknum == prevblk) and (drv == prevdrv) and (isWrite == prevop) and (cs == prevcs)) else ' '
+        e = 'X' if isError else e
+        prevblk = blknum
+        prevdrv = drv
+        prevop = isWrite
+        prevcs = cs
+        if verbosity == 'second':
+            tally['W' if isWrite else 'R'] += 1
+            tally[e] += 1
+    if (verbosity == 'block') or ((verbosity == 'errors') and isError):
+        logput(('blk', drv, blknum, isWrite, e, filename))
+    return e
+
+#
+# Pretty print a block read or written
+#
+def printblock(drv, blknum, isWrite, e, filename):
+    global col, logdrv
+    if drv != logdrv:
         if systemd:
             print('\nDrive {} ({})'.format(drv, filename))
         else:
             print('\n{}Drive {} ({}){}'.format(BLU, drv, filename, ENDC))
         col = 0
-    e = '+' if ((blknum == prevblk) and (drv == prevdrv) and (isWrite == prevop) and (cs == prevcs)) else ' '
-    e = 'X' if isError else e
+        logdrv = drv
     if systemd:
         c = 'W' if isWrite else 'R'
-        print(' {0}{1}{2:05d}'.format(e, c, blknum), end='', flush=True)
+        print(' {0}{1}{2:05d}'.format(e, c, blknum), end='')
     else:
         c = RED if isWrite else GRN
-        print('{0} {1}{2:05d}{3}'.format(c, e, blknum, ENDC), end='', flush=True)
+        print('{0} {1}{2:05d}{3}'.format(c, e, blknum, ENDC), end='')
     col += 1
     if col == 8:
         print('')
         col = 0
-    prevblk = blknum
-    prevdrv = drv
-    prevop = isWrite
-    prevcs = cs
 
 #
 # Augment filename by adding IP
@@ -132,44 +191,810 @@ def select_filename(filename, addr):
         with open(filename_with_ip, 'r+b'):
             pass
     except:
-        return filename
+        return delta_filename(filename, ip) if overlay else filename
     return filename_with_ip
 
 #
-# Read block with date/time update
+# Returns the name of the delta file for ip over base image filename,
+# basename-192.168.2.3.delta for basename.ext, creating it if need be
+#
+def delta_filename(filename, ip):
+    delta = os.path.splitext(augment_filename(filename, ip))[0] + DELTAEXT
+    if not os.path.exists(delta):
+        try:
+            Delta.create(delta)
+            log('Created {}'.format(delta))
+        except OSError as e:
+            log('Cannot create {}: {}'.format(delta, e))
+    return delta
+
+#
+# Log a message on a line of its own
 #
-def read3(dataport, addr, d):
-    global packet
+def log(msg):
+    logput(('msg', msg))
 
-    d = dataport.recvmore(d, 3)
+#
+# Queue item for the log writer thread.  If the queue is full the item is
+# dropped, rather than hold up the response to a request.
+#
+def logput(item):
+    global log_dropped
+    try:
+        log_queue.put_nowait(item)
+    except queue.Full:
+        with log_lock:
+            log_dropped += 1
 
-    if d[1] == 0x03:
-       filename = file1
-       drv = 1
-       skip = skip1
+#
+# Print a message on a line of its own
+#
+def printmsg(msg):
+    global col
+    if col != 0:
+        print('')
+        col = 0
+    if systemd:
+        print(msg)
     else:
-       filename = file2
-       drv = 2
-       skip = skip2
+        print('{}{}{}'.format(YEL, msg, ENDC))
+
+#
+# Print and reset the counts of requests in the last second
+#
+def printtally():
+    with log_lock:
+        t = tally.copy()
+        tally.clear()
+    if t['R'] or t['W']:
+        printmsg('{} reads, {} writes, {} duplicates, {} errors'.format(
+                 t['R'], t['W'], t['+'], t['X']))
+
+#
+# Log writer thread.  Prints items from the log queue until it gets None,
+# flushing stdout whenever the queue is empty.
+#
+def log_writer():
+    shown = 0           # Dropped items already reported
+    nextsum = time.time() + 1
+    while True:
+        timeout = None
+        if verbosity == 'second':
+            timeout = max(nextsum - time.time(), 0)
+        try:
+            item = log_queue.get(timeout=timeout)
+        except queue.Empty:
+            item = ()
+        if item is None:
+            break
+        if item and (item[0] == 'blk'):
+            printblock(*item[1:])
+        elif item:
+            printmsg(item[1])
+        if (verbosity == 'second') and (time.time() >= nextsum):
+            printtally()
+            nextsum = time.time() + 1
+        if log_dropped != shown:
+            printmsg('{} log items dropped'.format(log_dropped - shown))
+            shown = log_dropped
+        if log_queue.empty():
+            sys.stdout.flush()
+    if verbosity == 'second':
+        printtally()
+    sys.stdout.flush()
+
+def start_logging():
+    global log_thread
+    log_thread = threading.Thread(target=log_writer, daemon=True)
+    log_thread.start()
+
+#
+# Print everything queued, then stop the log writer thread
+#
+def stop_logging():
+    if log_thread:
+        log_queue.put(None)
+        log_thread.join()
+
+#
+# Client label for metrics: IP address, or 'serial'
+#
+def client_name(addr):
+    if not addr:
+        return 'serial'
+    ip = addr[0]
+    return ip[ip.rfind(":")+1:] if ip.startswith('::ffff:') else ip
+
+#
+# Quote a label value for the metrics report
+#
+def label(v):
+    return '"' + str(v).replace('\\', '\\\\').replace('"', '\\"') + '"'
+
+#
+# Request counts, byte rates, latencies and hot blocks, updated by the
+# worker threads and reported as plain text in Prometheus exposition format
+#
+class Metrics:
+    def __init__(self):
+        self.lock = threading.Lock()
+        self.start = time.time()
+        self.clients = Counter()    # Requests by (client, op)
+        self.drives = Counter()     # Requests by (drive, filename, op)
+        self.bytes = Counter()      # Bytes transferred by op
+        self.persec = {}            # [read, write] bytes by second
+        self.marks = Counter()      # Requests by printinfo() mark
+        self.resent = 0             # Responses sent again from cache
+        self.elided = 0             # Writes skipped as block unchanged
+        self.hist = [0] * (len(LATBINS) + 1)  # Latencies by LATBINS bucket
+        self.latsum = 0.0
+        self.hot = Counter()        # Requests by (filename, blknum)
+
+    # Count a request, which took secs to handle.  nbytes is the number of
+    # bytes read or written, e is the mark returned by printinfo().
+    def request(self, addr, drv, filename, isWrite, blknum, nbytes, e, secs,
+                resent=False, elided=False):
+        op = 'write' if isWrite else 'read'
+        now = int(time.time())
+        with self.lock:
+            self.clients[(client_name(addr), op)] += 1
+            self.drives[(drv, filename, op)] += 1
+            self.bytes[op] += nbytes
+            if now not in self.persec:
+                for s in [s for s in self.persec if s <= now - RATEWIN]:
+                    del self.persec[s]
+                self.persec[now] = [0, 0]
+            self.persec[now][isWrite] += nbytes
+            self.marks[e] += 1
+            self.resent += resent
+            self.elided += elided
+            self.hist[bisect.bisect_left(LATBINS, secs)] += 1
+            self.latsum += secs
+            self.hot[(filename, blknum)] += 1
+
+    def report(self):
+        now = time.time()
+        out = []
+        with self.lock:
+            out.append('veserver_uptime_seconds {:.0f}'.format(now - self.start))
+            for (c, op), n in sorted(self.clients.items()):
+                out.append('veserver_requests_total{{client={},op="{}"}} {}'.
+                           format(label(c), op, n))
+            for (drv, f, op), n in sorted(self.drives.items()):
+                out.append('veserver_drive_requests_total'
+                           '{{drive="{}",image={},op="{}"}} {}'.
+                           format(drv, label(f), op, n))
+            win = min(RATEWIN, max(now - self.start, 1))
+            for i, op in enumerate(('read', 'write')):
+                out.append('veserver_bytes_total{{op="{}"}} {}'.
+                           format(op, self.bytes[op]))
+                rate = sum(b[i] for s, b in self.persec.items()
+                           if s > now - RATEWIN) / win
+                out.append('veserver_bytes_per_second{{op="{}"}} {:.1f}'.
+                           format(op, rate))
+            out.append('veserver_duplicates_total {}'.format(self.marks['+']))
+            out.append('veserver_errors_total {}'.format(self.marks['X']))
+            out.append('veserver_resent_total {}'.format(self.resent))
+            out.append('veserver_writes_elided_total {}'.format(self.elided))
+            out.append('veserver_log_dropped_total {}'.format(log_dropped))
+            n = 0
+            for le, c in zip(LATBINS + ('+Inf',), self.hist):
+                n += c
+                out.append('veserver_latency_seconds_bucket{{le="{}"}} {}'.
+                           format(le, n))
+            out.append('veserver_latency_seconds_sum {:.6f}'.format(self.latsum))
+            out.append('veserver_latency_seconds_count {}'.format(n))
+            for (f, blk), c in self.hot.most_common(HOTBLKS):
+                out.append('veserver_hot_block_requests_total'
+                           '{{image={},block="{}"}} {}'.format(label(f), blk, c))
+        return '\n'.join(out) + '\n'
+
+metrics = Metrics()
+
+#
+# Serve the metrics report to HTTP GET requests
+#
+class MetricsHTTPHandler(BaseHTTPRequestHandler):
+    def do_GET(self):
+        body = metrics.report().encode()
+        self.send_response(200)
+        self.send_header('Content-Type', 'text/plain; version=0.0.4')
+        self.send_header('Content-Length', str(len(body)))
+        self.end_headers()
+        self.wfile.write(body)
+
+    def log_message(self, format, *args):
+        pass
+
+#
+# Write the metrics report to each connection to a Unix socket
+#
+class MetricsStreamHandler(socketserver.StreamRequestHandler):
+    def handle(self):
+        self.wfile.write(metrics.report().encode())
+
+#
+# Serve metrics in a thread of their own, over HTTP on localhost if where
+# is a port number, otherwise on the Unix socket at path where
+#
+def start_metrics(where):
+    if where.isdigit():
+        srv = HTTPServer(('localhost', int(where)), MetricsHTTPHandler)
+        print("Metrics at http://localhost:{}/".format(where))
+    else:
+        try:
+            os.unlink(where)
+        except OSError:
+            pass
+        srv = socketserver.UnixStreamServer(where, MetricsStreamHandler)
+        print("Metrics on Unix socket {}".format(where))
+    threading.Thread(target=srv.serve_forever, daemon=True).start()
+
+#
+# Hash of a block, used to spot blocks rewritten with the same contents
+#
+def blkhash(data):
+    return hashlib.blake2b(data, digest_size=16).digest()
+
+#
+# Runs of adjacent blocks at sorted byte offsets offs, as (start, end)
+#
+def runs(offs):
+    start = end = None
+    for b in offs:
+        if b != end:
+            if start is not None:
+                yield (start, end)
+            start = b
+        end = b + BLKSZ
+    if start is not None:
+        yield (start, end)
+
+#
+# Disk image, kept open and memory mapped for the life of the server
+# Blocks written are held in a write-back cache, so repeated writes to the
+# same block (directory and bitmap blocks, typically) only reach the image
+# once.  Writes which would leave a block unchanged are skipped altogether.
+#
+class Image:
+    def __init__(self, filename, readonly=False):
+        self.filename = filename
+        self.f = open(filename, 'rb' if readonly else 'r+b')
+        try:
+            self.mm = mmap.mmap(self.f.fileno(), 0, access=mmap.ACCESS_READ
+                                if readonly else mmap.ACCESS_DEFAULT)
+        except:
+            self.f.close()
+            raise
+        self.skip = check2MG(filename)  # Bytes of 2MG header
+        self.cache = {}         # Dirty blocks, by byte offset
+        self.kinds = {2: 'dir'} # Dir and index blocks seen, by block number
+        self.writes = 0         # Writes since cache last written back
+        self.elided = 0         # Unchanged blocks not written since then
+        self.hashes = {}        # Hash of blocks written, by byte offset
+        self.dirty = False      # Map has changes not yet flushed
+        self.lastflush = time.time()
+        self.lastwrite = time.time()
+
+    # Returns the block at byte offset b, short if past the end of image
+    def read(self, b):
+        if b in self.cache:
+            return self.cache[b]
+        return self.get(b)
+
+    # Write a whole block at byte offset b.  Returns False if the block
+    # already held data, so there was nothing to write.
+    def write(self, b, data):
+        if b + BLKSZ > self.size():
+            raise IOError('Block beyond end of image')
+        h = blkhash(data)
+        if b not in self.hashes:
+            self.hashes[b] = blkhash(self.cache[b] if b in self.cache
+                                     else self.get(b))
+        if self.hashes[b] == h:
+            self.elided += 1
+            return False
+        self.hashes[b] = h
+        self.lastwrite = time.time()
+        blknum = (b - self.skip) // BLKSZ
+        if blknum != 2:
+            self.kinds.pop(blknum, None)  # May not be dir or index any more
+        if cache_max == 0:
+            self.put(b, data)
+            self.dirty = True
+            self.flushdue()
+            return True
+        self.cache[b] = bytes(data)
+        self.writes += 1
+        if len(self.cache) >= cache_max:
+            self.writeback('full')
+        return True
+
+    # Having read block blknum, if it is a directory or index block, have
+    # the kernel read the blocks it points to in the background, on the
+    # basis that the client is about to ask for them.  Blocks found to be
+    # directory or index blocks are remembered, so that they are followed
+    # in turn when read.
+    def readahead(self, blknum, block):
+        kind = self.kinds.get(blknum)
+        blks = []
+        if kind == 'dir':
+            nxt = block[2] + 256 * block[3]
+            if nxt:
+                self.kinds[nxt] = 'dir'
+                blks.append(nxt)
+            for e in range(4, 4 + ENTPERBLK * ENTSZ, ENTSZ):
+                st = block[e] >> 4
+                key = block[e + 0x11] + 256 * block[e + 0x12]
+                if (st == 0) or (st >= 0xe) or (key == 0):
+                    continue    # Deleted entry or dir header
+                self.follow(st, key, blks)
+        elif kind == 'ext':
+            for e in (0x000, 0x100):  # Data fork, resource fork
+                self.follow(block[e], block[e + 1] + 256 * block[e + 2], blks)
+        elif kind in ('idx', 'mst'):
+            for i in range(0, 256):
+                p = block[i] + 256 * block[256 + i]
+                if p:
+                    if kind == 'mst':
+                        self.kinds[p] = 'idx'
+                    blks.append(p)
+        else:
+            return
+        offs = [blk * BLKSZ + self.skip for blk in blks[:readahead]]
+        self.willneed(sorted(b for b in offs if
+                             (b + BLKSZ <= self.size()) and
+                             (b not in self.cache)))
+
+    # Advise the kernel that the blocks at sorted byte offsets offs will be
+    # needed soon, a run of adjacent blocks at a time
+    def willneed(self, offs):
+        for start, end in runs(offs):
+            start -= start % mmap.PAGESIZE  # madvise() needs page alignment
+            self.mm.madvise(mmap.MADV_WILLNEED, start, end - start)
+
+    # Note the kind of key block for storage type st, and add it to blks
+    def follow(self, st, key, blks):
+        kind = {2: 'idx', 3: 'mst', 5: 'ext', 0xd: 'dir'}.get(st)
+        if kind and key:
+            self.kinds[key] = kind
+        if key:
+            blks.append(key)
+
+    # Write the cached blocks to the map, in order
+    def writeback(self, why):
+        if not self.cache:
+            return
+        for b in sorted(self.cache):
+            self.put(b, self.cache[b])
+        log('Wrote {} blks for {} writes to {} ({}), {} unchanged'.format(
+            len(self.cache), self.writes, self.filename, why, self.elided))
+        self.cache.clear()
+        self.writes = 0
+        self.elided = 0
+        self.dirty = True
+        self.flushdue()
+
+    # Flush according to policy
+    def flushdue(self):
+        if flush_secs is not None:
+            if time.time() - self.lastflush >= flush_secs:
+                self.flush()
+
+    # Write dirty pages back to the file on disk
+    def flush(self):
+        if self.dirty:
+            self.sync()
+            self.dirty = False
+        self.lastflush = time.time()
+
+    def close(self, why):
+        self.writeback(why)
+        self.flush()
+        self.mm.close()
+        self.f.close()
+
+    # Size of image in bytes, including any 2MG header
+    def size(self):
+        return len(self.mm)
+
+    # Block at byte offset b of the file, short if past the end
+    def get(self, b):
+        return self.mm[b : b + BLKSZ]
+
+    # Store a block at byte offset b of the file
+    def put(self, b, data):
+        self.mm[b : b + BLKSZ] = data
+
+    # Write changes back to the file on disk
+    def sync(self):
+        self.mm.flush()
+
+#
+# Per-client delta file, holding the blocks a client has written to a
+# shared base image.  A header is followed by an index with an entry for
+# each block of the base, giving the slot in the file holding the block,
+# or 0 if the block is unchanged.  Slots are allocated from 1 as blocks are
+# first written, so the file only grows as large as the blocks changed.
+#
+#   0                DELTAMAGIC
+#   8                Blocks in base image, 4 bytes LSB first, 0 if not known
+#   12               Reserved
+#   DELTAHDR         Index, 2 bytes LSB first per block
+#   DELTADATA        Slot 1, then slot 2 etc.
+#
+class Delta:
+    def __init__(self, filename, nblks):
+        self.f = open(filename, 'r+b')
+        try:
+            hdr = self.f.read(DELTAHDR)
+            if hdr[0:8] != DELTAMAGIC:
+                raise IOError('{} is not a delta file'.format(filename))
+            n = int.from_bytes(hdr[8:12], 'little')
+            if n == 0:
+                self.f.seek(8)
+                self.f.write(nblks.to_bytes(4, 'little'))
+            elif n != nblks:
+                raise IOError('{} is for a base of {} blks, not {}'.format(
+                              filename, n, nblks))
+            self.index = array.array('H', self.f.read(DELTADATA - DELTAHDR))
+        except:
+            self.f.close()
+            raise
+        if sys.byteorder == 'big':
+            self.index.byteswap()
+        self.slots = max(self.index, default=0)  # Slots in use
+
+    # Create an empty delta file
+    @staticmethod
+    def create(filename):
+        with open(filename, 'xb') as f:
+            f.write(DELTAMAGIC + bytes(DELTAHDR - len(DELTAMAGIC)))
+            f.truncate(DELTADATA)
+
+    # Returns block blknum, or None if it is not in the delta
+    def get(self, blknum):
+        slot = self.index[blknum] if blknum < len(self.index) else 0
+        if slot == 0:
+            return None
+        self.f.seek(DELTADATA + (slot - 1) * BLKSZ)
+        return self.f.read(BLKSZ)
+
+    # Advise the kernel that block blknum will be needed soon.  Returns
+    # False if it is not in the delta.
+    def willneed(self, blknum):
+        slot = self.index[blknum] if blknum < len(self.index) else 0
+        if slot == 0:
+            return False
+        if hasattr(os, 'posix_fadvise'):
+            os.posix_fadvise(self.f.fileno(), DELTADATA + (slot - 1) * BLKSZ,
+                             BLKSZ, os.POSIX_FADV_WILLNEED)
+        return True
+
+    # Store block blknum, in a new slot if it is not already in the delta.
+    # The block is written before the index entry pointing to it.
+    def put(self, blknum, data):
+        slot = self.index[blknum]
+        new = (slot == 0)
+        if new:
+            slot = self.slots + 1
+        self.f.seek(DELTADATA + (slot - 1) * BLKSZ)
+        self.f.write(data)
+        if new:
+            self.f.seek(DELTAHDR + 2 * blknum)
+            self.f.write(slot.to_bytes(2, 'little'))
+            self.index[blknum] = slot
+            self.slots = slot
 
-    filename = select_filename(filename, addr)
+    def sync(self):
+        self.f.flush()
+        os.fsync(self.f.fileno())
+
+    def close(self):
+        self.f.close()
+
+#
+# Disk image made up of a base image, which is only read, and a delta file
+# holding the blocks written by one client.  Reads look in the delta first.
+#
+class Overlay(Image):
+    def __init__(self, base, delta):
+        Image.__init__(self, base, readonly=True)
+        self.filename = delta
+        try:
+            self.delta = Delta(delta, (self.size() - self.skip) // BLKSZ)
+        except:
+            self.mm.close()
+            self.f.close()
+            raise
+
+    def close(self, why):
+        Image.close(self, why)
+        self.delta.close()
+
+    def get(self, b):
+        block = self.delta.get((b - self.skip) // BLKSZ)
+        return Image.get(self, b) if block is None else block
+
+    def put(self, b, data):
+        self.delta.put((b - self.skip) // BLKSZ, data)
+
+    def willneed(self, offs):
+        Image.willneed(self, [b for b in offs if
+                              not self.delta.willneed((b - self.skip) // BLKSZ)])
+
+    def sync(self):
+        self.delta.sync()
+
+#
+# Write base with the blocks in delta applied to a new image newbase
+#
+def merge(base, delta, newbase):
+    if os.path.exists(newbase):
+        print('{} already exists'.format(newbase))
+        sys.exit(1)
+    skip = check2MG(base)
+    d = Delta(delta, (os.path.getsize(base) - skip) // BLKSZ)
+    shutil.copyfile(base, newbase)
+    n = 0
+    with open(newbase, 'r+b') as f:
+        for blknum, slot in enumerate(d.index):
+            if slot:
+                f.seek(skip + blknum * BLKSZ)
+                f.write(d.get(blknum))
+                n += 1
+    d.close()
+    print('Merged {} blks from {} into {}'.format(n, delta, newbase))
+
+#
+# Serves all requests for one disk image, in the order they arrive.  In
+# UDP mode each Worker has a thread of its own, so clients using different
+# images are served concurrently.  In serial mode requests are handled
+# as they are received.
+#
+class Worker:
+    def __init__(self, filename, ino, base):
+        self.filename = filename
+        self.ino = ino          # Inode of file, to notice it being replaced
+        self.base = base        # Base image if filename is a delta file
+        self.image = None       # Opened on first request
+        self.responses = {}     # Last response sent, by (client addr, drive)
+        self.queue = None
+        if not serial_port:
+            self.queue = queue.Queue()
+            self.thread = threading.Thread(target=self.run, daemon=True)
+            self.thread.start()
+
+    # Return the Image, opening it on first use
+    def get_image(self):
+        if self.image is None:
+            if self.base:
+                self.image = Overlay(self.base, self.filename)
+            else:
+                self.image = Image(self.filename)
+        return self.image
+
+    # Handle request d from addr, received at time t0, now or in the
+    # worker thread
+    def submit(self, dataport, addr, d, t0):
+        if self.queue:
+            self.queue.put((dataport, addr, d, t0))
+        else:
+            self.handle(dataport, addr, d, t0)
+
+    def handle(self, dataport, addr, d, t0):
+        if (d[1] == 0x03) or (d[1] == 0x05):
+            read3(dataport, addr, d, self, t0)
+        else:
+            write(dataport, addr, d, self, t0)
+
+    # Write back the cache once it has seen no writes for cache_idle secs,
+    # and flush the image once it has been dirty for flush_secs
+    def idle(self):
+        img = self.image
+        if img is None:
+            return
+        now = time.time()
+        if img.cache and (now - img.lastwrite >= cache_idle):
+            img.writeback('idle')
+        if img.dirty and (flush_secs is not None) and \
+           (now - img.lastflush >= flush_secs):
+            img.flush()
+
+    def run(self):
+        while True:
+            try:
+                req = self.queue.get(timeout=idle_secs())
+            except queue.Empty:
+                req = ()
+            if req is None:
+                break
+            try:
+                if req:
+                    self.handle(*req)
+                self.idle()
+            except Exception as e:
+                log('{}: {}'.format(self.filename, e))
+        self.close(self.why)
+
+    # Finish requests already queued, then close the image
+    def stop(self, why):
+        if self.queue:
+            self.why = why
+            self.queue.put(None)
+            self.thread.join()
+        else:
+            self.close(why)
+
+    def close(self, why):
+        if self.image:
+            try:
+                self.image.close(why)
+            except:
+                pass
+            self.image = None
+
+#
+# Inode of filename, or None if it does not exist
+#
+def inode(filename):
+    try:
+        return os.stat(filename).st_ino
+    except OSError:
+        return None
+
+#
+# Return the Worker for filename, which is a delta file over base if base
+# is given, starting one if needed.  If either file has been replaced since
+# the Worker opened it, the old Worker is retired.
+#
+def get_worker(filename, base=None):
+    ino = (inode(filename), inode(base) if base else None)
+    w = workers.get(filename)
+    if w and (w.ino != ino):
+        w.stop('replaced')
+        w = None
+    if w is None:
+        w = workers[filename] = Worker(filename, ino, base)
+    return w
+
+#
+# Modification time of the directory holding filename, which changes when
+# a per-client image appears or disappears, or an image is replaced
+#
+def dir_stamp(filename):
+    try:
+        return os.stat(os.path.dirname(os.path.abspath(filename))).st_mtime_ns
+    except OSError:
+        return None
+
+#
+# Return the Worker for requests from addr for drive drv.  The choice of
+# image is cached, and made again only when the directory changes.
+#
+def route(addr, drv):
+    filename = file1 if drv == 1 else file2
+    key = (addr[0] if addr else None, drv)
+    stamp = dir_stamp(filename)
+    r = routes.get(key)
+    if r and (r[1] == stamp):
+        return r[0]
+    f = select_filename(filename, addr)
+    w = get_worker(f, filename if f.endswith(DELTAEXT) else None)
+    routes[key] = (w, stamp)
+    return w
+
+#
+# Seconds to wait for a request before checking whether to flush
+#
+def idle_secs():
+    t = [x for x in (flush_secs, cache_idle if cache_max else None) if x]
+    return min(t) if t else None
+
+#
+# Record request d from addr, received at time t0, to the trace file, as
+#   SECS CLIENT OPCODE BLKNUM [DATA]
+# with the client's address and port, the opcode and, for writes, the 512
+# data bytes in hex.  Called by the workers, for requests which are not
+# retransmits answered by resend(), so each line is a request the client
+# really made.
+#
+def trace(addr, d, t0):
+    if not addr:
+        client = 'serial'
+    else:
+        ip = client_name(addr)
+        client = ('[{}]:{}' if ':' in ip else '{}:{}').format(ip, addr[1])
+    line = '{:.6f} {} {:02x} {}'.format(t0 - trace_start, client,
+                                        d[1], d[2] + 256 * d[3])
+    if d[1] in (0x02, 0x04):
+        line += ' ' + bytes(d[5 : 5 + BLKSZ]).hex()
+    with trace_lock:
+        trace_file.write(line + '\n')
+
+#
+# Finish outstanding requests, then flush and close all images
+#
+def stop_workers(why):
+    for w in workers.values():
+        w.stop(why)
+    workers.clear()
+    routes.clear()
+
+#
+# Turn SIGTERM (systemctl stop) into a normal exit, so caches are written
+#
+def sigterm(signum, frame):
+    global stopping
+    stopping = True
+    sys.exit(0)
+
+#
+# If the request is a retransmit of the last request from addr for drive
+# (same opcode, block and payload, within resend_secs), send the same
+# response again without touching the image and return True.
+#
+def resend(dataport, addr, drv, op, blknum, payload, worker, t0):
+    r = worker.responses.get((addr, drv))
+    if (r is None) or (resend_secs == 0):
+        return False
+    rop, rblk, rpayload, rtime, rcs, rdata = r
+    if (op != rop) or (blknum != rblk) or (payload != rpayload) or \
+       (time.time() - rtime > resend_secs):
+        return False
+    if not serial_port:
+        rdata[0] = next(packets) & 0xff  # Packet number is not checksummed
+    isWrite = op in (0x02, 0x04)
+    e = printinfo(drv, blknum, isWrite, False, rcs, worker.filename)
+    dataport.sendto(rdata, addr)
+    metrics.request(addr, drv, worker.filename, isWrite, blknum, 0, e,
+                    time.perf_counter() - t0, resent=True)
+    return True
+
+#
+# Remember the response to a request, so it can be sent again if the
+# request is retransmitted
+#
+def remember(addr, drv, op, blknum, payload, worker, cs, data):
+    worker.responses[(addr, drv)] = (op, blknum, payload, time.time(),
+                                     cs, data)
+
+#
+# Forget all responses, to reads and writes from every client, for a block
+# which has just been written.  A read would return stale data, and a
+# write acked again from the cache would not be applied over the new data.
+#
+def forget(blknum, worker):
+    for k in [k for k, r in worker.responses.items() if r[1] == blknum]:
+        del worker.responses[k]
+
+#
+# Read block with date/time update
+#
+def read3(dataport, addr, d, worker, t0):
+    drv = 1 if d[1] == 0x03 else 2
+    filename = worker.filename
 
     blknum = d[2] + 256 * d[3]
 
+    if resend(dataport, addr, drv, d[1], blknum, b'', worker, t0):
+        return
+    if trace_file:
+        trace(addr, d, t0)
+
     err = False
     try:
-        with open(filename, 'r+b') as f:
-            b = blknum * BLKSZ + skip
-            f.seek(b)
-            block = f.read(BLKSZ)
+        img = worker.get_image()
+        block = img.read(blknum * BLKSZ + img.skip)
+        if len(block) != BLKSZ:
+            err = True         # Beyond end of image
     except:
         err = True
 
     dt = getDateTimeBytes()
     l = []
     if not serial_port:
-        appendbyte(l, packet & 0xff, 0)  # Packet number
-        packet += 1
+        appendbyte(l, next(packets) & 0xff, 0)  # Packet number
     cs = appendbyte(l, 0xc5, 0)   # "E"
     cs = appendbyte(l, d[1], cs)  # 0x03 or 0x05
     cs = appendbyte(l, d[2], cs)  # Block num LSB
@@ -182,77 +1007,86 @@ def read3(dataport, addr, d):
 
     # Signal read errors by responding with incorrect checksum
     if err:
-        cs += 1
+        cs = (cs + 1) & 0xff
     else:
-        cs = 0
-        for i in range (0, BLKSZ):
-            cs = appendbyte(l, block[i], cs)
+        cs = reduce(xor, block, 0)
+        l.extend(block)
 
 
     appendbyte(l, cs, cs)         # Checksum for datablock
 
-    printinfo(drv, blknum, False, err, cs, filename)
+    e = printinfo(drv, blknum, False, err, cs, filename)
 
-    b = dataport.sendto(bytearray(l), addr)
+    data = bytearray(l)
+    if not err:
+        remember(addr, drv, d[1], blknum, b'', worker, cs, data)
+    else:
+        worker.responses.pop((addr, drv), None)
+    b = dataport.sendto(data, addr)
     #print('Sent {} bytes to {}'.format(b, addr))
+    metrics.request(addr, drv, filename, False, blknum, 0 if err else BLKSZ,
+                    e, time.perf_counter() - t0)
+
+    # Prefetch while the response is on its way
+    if (not err) and readahead:
+        img.readahead(blknum, block)
 
 #
 # Write block
 #
-def write(dataport, addr, d):
-    global packet
-
-    d = dataport.recvmore(d, BLKSZ + 4)
+def write(dataport, addr, d, worker, t0):
+    drv = 1 if d[1] == 0x02 else 2
+    filename = worker.filename
 
-    if d[1] == 0x02:
-       filename = file1
-       drv = 1
-       skip = skip1
-    else:
-       filename = file2
-       drv = 2
-       skip = skip2
-
-    filename = select_filename(filename, addr)
-
-    cs = 0
-    for i in range (0, BLKSZ):
-         cs ^= d[i+5]
+    cs = reduce(xor, d[5 : 5 + BLKSZ], 0)
 
     blknum = d[2] + 256 * d[3]
 
+    payload = bytes(d[5 : 5 + BLKSZ])
+    if resend(dataport, addr, drv, d[1], blknum, payload, worker, t0):
+        return
+    if trace_file:
+        trace(addr, d, t0)
+
     err = False
+    elided = False
     if cs == d[517]:
         try:
-            with open(filename, 'r+b') as f:
-                b = blknum * BLKSZ + skip
-                f.seek(b)
-                for i in range (0, BLKSZ):
-                    f.write(bytes([d[i+5]]))
+            img = worker.get_image()
+            if img.write(blknum * BLKSZ + img.skip, payload):
+                forget(blknum, worker)
+            else:
+                elided = True   # Block already held payload
         except:
             err = True         # Write error
     else:
-        err == True            # Bad checksum
+        err = True             # Bad checksum
 
     # Signal write errors by responding with bad data checksum.
     # Use sender's checksum + 1, so there is never an inadvertent match.
     if err:
-        cs = d[517] + 1
+        cs = (d[517] + 1) & 0xff
 
     l = []
     if not serial_port:
-        appendbyte(l, packet & 0xff, 0)  # Packet number
-        packet += 1
+        appendbyte(l, next(packets) & 0xff, 0)  # Packet number
     appendbyte(l, 0xc5, 0)     # "E"
     appendbyte(l, d[1], 0)     # 0x02 or 0x04
     appendbyte(l, d[2], 0)     # Block num LSB
     appendbyte(l, d[3], 0)     # Block num MSB
     appendbyte(l, cs, 0)       # Checksum of datablock
 
-    printinfo(drv, blknum, True, err, cs, filename)
+    e = printinfo(drv, blknum, True, err, cs, filename)
 
-    b = dataport.sendto(bytearray(l), addr)
+    data = bytearray(l)
+    if not err:
+        remember(addr, drv, d[1], blknum, payload, worker, cs, data)
+    else:
+        worker.responses.pop((addr, drv), None)
+    b = dataport.sendto(data, addr)
     #print('Sent {} bytes to {}'.format(b, addr))
+    metrics.request(addr, drv, filename, True, blknum, 0 if err else BLKSZ,
+                    e, time.perf_counter() - t0, elided=elided)
 
 #
 # See if file is a 2MG and, if so, that it contains .PO image
@@ -260,7 +1094,7 @@ def write(dataport, addr, d):
 #
 def check2MG(filename):
     try:
-        with open(filename, 'r+b') as f:
+        with open(filename, 'rb') as f:
             hdr = f.read(16)
     except:
         return 0
@@ -309,7 +1143,10 @@ class DataPort:
             else:
                 return data, None
         else:
-            return self.impl.recvfrom(1024)
+            try:
+                return self.impl.recvfrom(1024)
+            except socket.timeout:
+                raise DataPort.Timeout
 
     def recvmore(self, data, remaining_bytes):
         if self.stream:
@@ -331,6 +1168,28 @@ def usage():
     print('  -2 FNAME, --disk2=FNAME  Specify filename for disk 2 image');
     print('  -s PORT, --serial=PORT   Use a serial link instead of ethernet');
     print('  -b BAUD, --baud=BAUD     Baud rate for serial link');
+    print('  -f WHEN, --flush=WHEN    Flush writes to disk: always, never or');
+    print('                           at most every WHEN seconds');
+    print('  -c N, --cache=N          Cache up to N dirty blocks per image,');
+    print('                           0 to write through (default 64)');
+    print('  -i SECS, --idle=SECS     Write cache back after SECS with no');
+    print('                           writes (default 1)');
+    print('  -r SECS, --resend=SECS   Answer retransmits within SECS from');
+    print('                           cache, 0 to disable (default 1)');
+    print('  -a N, --readahead=N      Prefetch up to N blocks listed in each');
+    print('                           dir or index block read (default 256)');
+    print('  -v LEVEL, --verbosity=LEVEL  Log each block, a summary each');
+    print('                           second or errors only: block, second');
+    print('                           or errors (default block)');
+    print('  -q, --quiet              Log errors only, same as -v errors');
+    print('  -m WHERE, --metrics=WHERE  Serve metrics on localhost TCP port');
+    print('                           WHERE, or Unix socket at path WHERE');
+    print('  -o, --overlay            Keep each client\'s writes in a delta file');
+    print('                           instead of writing to the disk image');
+    print('  -t FILE, --trace=FILE    Record requests to FILE, for veload.py');
+    print('usage: veserver --merge BASE DELTA NEWBASE');
+    print('  -g, --merge              Write BASE with the blocks in DELTA');
+    print('                           applied to new image NEWBASE');
 
 #
 # Entry point
@@ -340,8 +1199,10 @@ def usage():
 if 'INVOCATION_ID' in os.environ:
     systemd = True
 
-short_opts = "hp1:2:s:b:"
-long_opts = ["help", "prodos25", "disk1=", "disk2=", "serial=", "baud="]
+short_opts = "hp1:2:s:b:f:c:i:r:a:v:qm:ogt:"
+long_opts = ["help", "prodos25", "disk1=", "disk2=", "serial=", "baud=",
+             "flush=", "cache=", "idle=", "resend=", "readahead=", "verbosity=",
+             "quiet", "metrics=", "overlay", "merge", "trace="]
 try:
     args, vals = getopt.getopt(sys.argv[1:], short_opts, long_opts)
 except getopt.error as e:
@@ -363,29 +1224,106 @@ for a, v in args:
         serial_port = v
     elif a in ('-b', '--baud'):
         baud_rate = int(v)
+    elif a in ('-f', '--flush'):
+        if v == 'always':
+            flush_secs = 0
+        elif v == 'never':
+            flush_secs = None
+        else:
+            try:
+                flush_secs = float(v)
+            except ValueError:
+                usage()
+                sys.exit(2)
+    elif a in ('-c', '--cache'):
+        cache_max = int(v)
+    elif a in ('-i', '--idle'):
+        cache_idle = float(v)
+    elif a in ('-r', '--resend'):
+        resend_secs = float(v)
+    elif a in ('-a', '--readahead'):
+        readahead = int(v)
+    elif a in ('-v', '--verbosity'):
+        if v not in ('block', 'second', 'errors'):
+            usage()
+            sys.exit(2)
+        verbosity = v
+    elif a in ('-q', '--quiet'):
+        verbosity = 'errors'
+    elif a in ('-m', '--metrics'):
+        metrics_at = v
+    elif a in ('-o', '--overlay'):
+        overlay = True
+    elif a in ('-t', '--trace'):
+        trace_to = v
+    elif a in ('-g', '--merge'):
+        if len(vals) != 3:
+            usage()
+            sys.exit(2)
+        merge(*vals)
+        sys.exit(0)
 
-print("VEServer v1.3")
+if not hasattr(mmap.mmap, 'madvise'):
+    readahead = 0       # No way to ask for blocks in the background
+
+print("VEServer v1.13")
 if pd25:
     print("ProDOS 2.5+ Clock Driver")
 else:
     print("Legacy ProDOS Clock Driver")
 
 print("Disk 1: {}".format(file1))
-skip1 = check2MG(file1)
+check2MG(file1)
 print("Disk 2: {}".format(file2))
-skip2 = check2MG(file2)
+check2MG(file2)
+if flush_secs is None:
+    print("Writes flushed by OS")
+elif flush_secs == 0:
+    print("Writes flushed immediately")
+else:
+    print("Writes flushed at most every {} secs".format(flush_secs))
+if cache_max:
+    print("Write-back cache of {} blks, written after {} secs idle".format(
+          cache_max, cache_idle))
+else:
+    print("No write-back cache")
+if overlay:
+    print("Writes kept in a delta file for each client")
+if trace_to:
+    trace_file = open(trace_to, 'w')
+    trace_start = time.perf_counter()
+    print("Recording requests to {}".format(trace_to))
+if metrics_at:
+    start_metrics(metrics_at)
+start_logging()
 
-with DataPort(serial_port, baud_rate) as dataport:
-    while True:
-        try:
-            data, address = dataport.recvfrom(2)
-            #print('Received {} bytes from {}'.format(len(data), address))
-            if (data[0] == 0xc5):
-                if (data[1] == 0x03) or (data[1] == 0x05):
-                    read3(dataport, address, data)
-                elif (data[1] == 0x02) or (data[1] == 0x04):
-                    write(dataport, address, data)
-        except DataPort.Timeout:
-            pass
+signal.signal(signal.SIGTERM, sigterm)
+
+try:
+    with DataPort(serial_port, baud_rate) as dataport:
+        while True:
+            try:
+                data, address = dataport.recvfrom(2)
+                t0 = time.perf_counter()
+                #print('Received {} bytes from {}'.format(len(data), address))
+                if (data[0] == 0xc5):
+                    if (data[1] == 0x03) or (data[1] == 0x05):
+                        data = dataport.recvmore(data, 3)
+                        drv = 1 if data[1] == 0x03 else 2
+                        route(address, drv).submit(dataport, address, data, t0)
+                    elif (data[1] == 0x02) or (data[1] == 0x04):
+                        data = dataport.recvmore(data, BLKSZ + 4)
+                        drv = 1 if data[1] == 0x02 else 2
+                        route(address, drv).submit(dataport, address, data, t0)
+            except DataPort.Timeout:
+                pass
+            if serial_port:
+                for w in workers.values():
+                    w.idle()
+finally:
+    stop_workers('stop' if stopping else 'exit')
+    stop_logging()
+    if trace_file:
+        trace_file.close()
 
 